@@ -0,0 +1,299 @@
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "darray.h"
+
+#include "integerdb.h"
+
+#define LINELEN (1024)
+#define SHAPELEN (2000)
+
+/*
+ * Micro-benchmarks of the database core, and a generator of random command
+ * streams for differential testing.
+ *
+ *     integerdb_bench            runs every benchmark
+ *     integerdb_bench gen <seed> <count>
+ *                                prints a random command stream
+ *
+ * Allocations are counted by wrapping the allocator at link time.
+ */
+
+static size_t allocs = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    allocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    allocs++;
+    return __real_realloc(ptr, size);
+}
+
+static unsigned long long rng_state = 1;
+
+static unsigned rng_next(unsigned bound) {
+    rng_state = rng_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (rng_state >> 33) % bound;
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Commands run while building shapes print to nowhere. */
+static int quiet_out = -1;
+
+static void quiet(int on) {
+    fflush(stdout);
+    if (on) {
+        quiet_out = dup(STDOUT_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+    } else {
+        dup2(quiet_out, STDOUT_FILENO);
+        close(quiet_out);
+    }
+}
+
+static void run(darray *snapshots, darray *entries, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static void run(darray *snapshots, darray *entries, const char *fmt, ...) {
+    char line[LINELEN];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(line, LINELEN, fmt, ap);
+    va_end(ap);
+
+    char *args = line;
+    char *comm = strsep(&args, " ");
+    command_dispatch(comm, args, snapshots, entries);
+}
+
+/*
+ * Shapes of reference graphs, each with SHAPELEN entries:
+ * - chain: every entry references the next one;
+ * - fan: one entry references all the others;
+ * - diamond: layers of entries, each referencing two entries of the next layer.
+ */
+static void build_chain(darray *snapshots, darray *entries) {
+    run(snapshots, entries, "set c%d 1 2 3", SHAPELEN - 1);
+    for (int i = SHAPELEN - 2; i >= 0; i--) {
+        run(snapshots, entries, "set c%d %u c%d %u", i,
+                rng_next(100), i + 1, rng_next(100));
+    }
+}
+
+static void build_fan(darray *snapshots, darray *entries) {
+    run(snapshots, entries, "set hub 0");
+    for (int i = 0; i < SHAPELEN - 1; i++) {
+        run(snapshots, entries, "set f%d %u %u", i,
+                rng_next(100), rng_next(100));
+        run(snapshots, entries, "append hub f%d", i);
+    }
+}
+
+static void build_diamond(darray *snapshots, darray *entries) {
+    const int width = 20;
+    for (int i = SHAPELEN - 1; i >= 0; i--) {
+        int layer = i / width;
+        if (layer == (SHAPELEN - 1) / width) {
+            run(snapshots, entries, "set d%d %u", i, rng_next(100));
+        } else {
+            int next = (layer + 1) * width;
+            int last = next + width < SHAPELEN ? width : SHAPELEN - next;
+            run(snapshots, entries, "set d%d d%u d%u", i,
+                    next + rng_next(last), next + rng_next(last));
+        }
+    }
+}
+
+static void report(const char *name, size_t ops, double start,
+        size_t start_allocs) {
+    double ns = now_ns() - start;
+    size_t count = allocs - start_allocs;
+    quiet(0);
+    printf("%-24s %12.1f ns/op %10.2f allocs/op\n",
+            name, ns / ops, (double) count / ops);
+    fflush(stdout);
+    quiet(1);
+}
+
+static void bench_refs() {
+    entry *ent1 = new_entry("a");
+    entry *ent2 = new_entry("b");
+    const size_t ops = 1000;
+
+    double start = now_ns();
+    size_t start_allocs = allocs;
+    for (size_t i = 0; i < ops; i++) {
+        entry_add_ref(ent1, ent2);
+    }
+    report("entry_add_ref", ops, start, start_allocs);
+
+    start = now_ns();
+    start_allocs = allocs;
+    for (size_t i = 0; i < ops; i++) {
+        entry_del_ref(ent1, ent2);
+    }
+    report("entry_del_ref", ops, start, start_allocs);
+
+    del_entry(ent1);
+    del_entry(ent2);
+}
+
+static void bench_parse(darray *entries) {
+    char line[LINELEN];
+    char buf[LINELEN];
+    size_t len = 0;
+    for (int i = 0; i < 100; i++) {
+        len += sprintf(line + len, "%s%u", i == 0 ? "" : " ", rng_next(1000));
+    }
+    entry *self = new_entry("self");
+    const size_t ops = 10000;
+
+    double start = now_ns();
+    size_t start_allocs = allocs;
+    for (size_t i = 0; i < ops; i++) {
+        strcpy(buf, line);
+        char *args = buf;
+        darray *elements = parse_elements(&args, entries, self);
+        darray_set_item_free(elements, free);
+        del_darray(elements);
+    }
+    report("parse_elements (100)", ops, start, start_allocs);
+
+    del_entry(self);
+}
+
+static void bench_shape(const char *shape,
+        void (*build)(darray *, darray *), const char *top) {
+    darray *snapshots = new_darray((consumer) del_snapshot);
+    darray *entries = new_darray((consumer) del_entry);
+    char name[64];
+    build(snapshots, entries);
+
+    const size_t ops = 20;
+    double start = now_ns();
+    size_t start_allocs = allocs;
+    for (size_t i = 0; i < ops; i++) {
+        darray *clone = entries_clone(entries);
+        del_darray(clone);
+    }
+    snprintf(name, sizeof(name), "entries_clone %s", shape);
+    report(name, ops, start, start_allocs);
+
+    element *ele = new_ent_ele(entries_lookup(entries, top));
+    value min = VALUE_MAX, max = VALUE_MIN;
+    total sum = 0;
+    size_t len = 0;
+
+    start = now_ns();
+    start_allocs = allocs;
+    for (size_t i = 0; i < ops; i++) {
+        element_agg_min(ele, &min);
+        element_agg_max(ele, &max);
+        element_agg_sum(ele, &sum);
+        element_agg_len(ele, &len);
+    }
+    snprintf(name, sizeof(name), "element_agg_* %s", shape);
+    report(name, ops * 4, start, start_allocs);
+
+    free(ele);
+    del_darray(snapshots);
+    del_darray(entries);
+}
+
+static void generate(unsigned long long seed, size_t count) {
+    const char *reads[] = {
+        "get", "min", "max", "sum", "len", "forward", "backward", "type"
+    };
+    const char *changes[] = {
+        "set", "set", "set", "push", "append"
+    };
+    const char *edits[] = {
+        "rev", "uniq", "sort", "del", "purge", "pop"
+    };
+    size_t nreads = sizeof(reads) / sizeof(reads[0]);
+    size_t nchanges = sizeof(changes) / sizeof(changes[0]);
+    size_t nedits = sizeof(edits) / sizeof(edits[0]);
+
+    rng_state = seed;
+    for (size_t i = 0; i < count; i++) {
+        unsigned kind = rng_next(100);
+        unsigned key = rng_next(16);
+        if (kind < 40) {
+            printf("%s k%u", changes[rng_next(nchanges)], key);
+            unsigned len = 1 + rng_next(8);
+            for (unsigned j = 0; j < len; j++) {
+                if (rng_next(4) == 0) {
+                    printf(" k%u", rng_next(16));
+                } else {
+                    printf(" %d", (int) rng_next(2001) - 1000);
+                }
+            }
+            putchar('\n');
+        } else if (kind < 70) {
+            printf("%s k%u\n", reads[rng_next(nreads)], key);
+        } else if (kind < 80) {
+            printf("%s k%u\n", edits[rng_next(nedits)], key);
+        } else if (kind < 85) {
+            printf("pick k%u %u\n", key, 1 + rng_next(5));
+        } else if (kind < 88) {
+            printf("pluck k%u %u\n", key, 1 + rng_next(5));
+        } else if (kind < 91) {
+            printf("snapshot\n");
+        } else if (kind < 95) {
+            const char *snaps[] = { "drop", "rollback", "checkout" };
+            printf("%s %u\n", snaps[rng_next(3)], 1 + rng_next(8));
+        } else {
+            const char *lists[] = { "keys", "entries", "snapshots" };
+            printf("list %s\n", lists[rng_next(3)]);
+        }
+    }
+    printf("bye\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc == 4 && strcmp(argv[1], "gen") == 0) {
+        generate(strtoull(argv[2], NULL, 10), strtoul(argv[3], NULL, 10));
+        return 0;
+    }
+    if (argc != 1) {
+        fprintf(stderr, "usage: %s [gen <seed> <count>]\n", argv[0]);
+        return 1;
+    }
+
+    darray *entries = new_darray((consumer) del_entry);
+
+    quiet(1);
+    bench_refs();
+    bench_parse(entries);
+    bench_shape("chain", build_chain, "c0");
+    bench_shape("fan", build_fan, "hub");
+    bench_shape("diamond", build_diamond, "d0");
+    quiet(0);
+
+    del_darray(entries);
+
+    return 0;
+}
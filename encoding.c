@@ -0,0 +1,396 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "encoding.h"
+
+#define WORDBITS (64)
+#define STRIDE (64)
+
+enum enc_type { RLE, DELTA };
+
+struct encoded {
+    enum enc_type type;
+    size_t len;
+    value min;
+    value max;
+    total sum;
+    union {
+        struct {
+            size_t nruns;
+            value *values;
+            unsigned *counts;
+            uint32_t *starts;
+        } rle;
+        struct {
+            value first;
+            unsigned width;
+            size_t nwords;
+            uint64_t *words;
+            value *marks;
+        } delta;
+    } data;
+};
+
+static unsigned bit_width(uvalue num) {
+    unsigned width = 0;
+    while (num != 0) {
+        width++;
+        num >>= 1;
+    }
+
+    return width;
+}
+
+static uvalue delta_at(const encoded *enc, size_t i) {
+    unsigned width = enc->data.delta.width;
+    if (width == 0) {
+        return 0;
+    }
+
+    size_t bit = i * width;
+    size_t word = bit / WORDBITS;
+    unsigned shift = bit % WORDBITS;
+    uint64_t val = enc->data.delta.words[word] >> shift;
+    if (shift + width > WORDBITS) {
+        val |= enc->data.delta.words[word + 1] << (WORDBITS - shift);
+    }
+
+    if (width == WORDBITS) {
+        return val;
+    }
+
+    return val & ((UINT64_C(1) << width) - 1);
+}
+
+/* Every STRIDE-th run or value is also kept whole, to jump close to an index. */
+static size_t strides(size_t len) {
+    return (len + STRIDE - 1) / STRIDE;
+}
+
+static size_t rle_size(size_t nruns) {
+    return nruns * (sizeof(value) + sizeof(unsigned))
+        + strides(nruns) * sizeof(uint32_t);
+}
+
+static size_t delta_words(size_t len, unsigned width) {
+    if (len < 2) {
+        return 0;
+    }
+
+    return ((len - 1) * width + WORDBITS - 1) / WORDBITS;
+}
+
+static size_t delta_size(size_t len, unsigned width) {
+    return (delta_words(len, width) + 1) * sizeof(uint64_t)
+        + strides(len) * sizeof(value);
+}
+
+static encoded *encode_rle(const value *nums, size_t len, size_t nruns) {
+    encoded *enc = (encoded *) malloc(sizeof(encoded));
+    if (enc == NULL) {
+        return NULL;
+    }
+
+    enc->type = RLE;
+    enc->data.rle.nruns = nruns;
+    enc->data.rle.values = (value *) malloc(nruns * sizeof(value));
+    enc->data.rle.counts = (unsigned *) malloc(nruns * sizeof(unsigned));
+    enc->data.rle.starts = (uint32_t *) malloc(strides(nruns)
+            * sizeof(uint32_t));
+    if (enc->data.rle.values == NULL || enc->data.rle.counts == NULL
+            || enc->data.rle.starts == NULL) {
+        del_encoded(enc);
+        return NULL;
+    }
+
+    size_t run = 0;
+    enc->data.rle.values[0] = nums[0];
+    enc->data.rle.counts[0] = 1;
+    enc->data.rle.starts[0] = 0;
+    for (size_t i = 1; i < len; i++) {
+        if (nums[i] == enc->data.rle.values[run]) {
+            enc->data.rle.counts[run]++;
+        } else {
+            run++;
+            enc->data.rle.values[run] = nums[i];
+            enc->data.rle.counts[run] = 1;
+            if (run % STRIDE == 0) {
+                enc->data.rle.starts[run / STRIDE] = i;
+            }
+        }
+    }
+
+    return enc;
+}
+
+static encoded *encode_delta(const value *nums, size_t len, unsigned width) {
+    encoded *enc = (encoded *) malloc(sizeof(encoded));
+    if (enc == NULL) {
+        return NULL;
+    }
+
+    enc->type = DELTA;
+    enc->data.delta.first = nums[0];
+    enc->data.delta.width = width;
+    enc->data.delta.nwords = delta_words(len, width);
+    enc->data.delta.words = (uint64_t *) calloc(enc->data.delta.nwords + 1,
+            sizeof(uint64_t));
+    enc->data.delta.marks = (value *) malloc(strides(len) * sizeof(value));
+    if (enc->data.delta.words == NULL || enc->data.delta.marks == NULL) {
+        del_encoded(enc);
+        return NULL;
+    }
+    for (size_t i = 0; i < len; i += STRIDE) {
+        enc->data.delta.marks[i / STRIDE] = nums[i];
+    }
+
+    for (size_t i = 1; i < len && width != 0; i++) {
+        uint64_t delta = (uvalue) nums[i] - (uvalue) nums[i - 1];
+        size_t bit = (i - 1) * width;
+        size_t word = bit / WORDBITS;
+        unsigned shift = bit % WORDBITS;
+        enc->data.delta.words[word] |= delta << shift;
+        if (shift + width > WORDBITS) {
+            enc->data.delta.words[word + 1] |= delta >> (WORDBITS - shift);
+        }
+    }
+
+    return enc;
+}
+
+encoded *encode_ints(const value *nums, size_t len, size_t raw_size) {
+    if (len == 0 || len > UINT32_MAX) {
+        return NULL;
+    }
+
+    size_t nruns = 1;
+    int sorted = 1;
+    uvalue max_delta = 0;
+    value min = nums[0], max = nums[0];
+    total sum = nums[0];
+    for (size_t i = 1; i < len; i++) {
+        if (nums[i] != nums[i - 1]) {
+            nruns++;
+        }
+        if (nums[i] < nums[i - 1]) {
+            sorted = 0;
+        } else if ((uvalue) nums[i] - (uvalue) nums[i - 1] > max_delta) {
+            max_delta = (uvalue) nums[i] - (uvalue) nums[i - 1];
+        }
+        if (nums[i] < min) { min = nums[i]; }
+        if (nums[i] > max) { max = nums[i]; }
+        sum += nums[i];
+    }
+
+    unsigned width = bit_width(max_delta);
+    size_t rle_bytes = rle_size(nruns);
+    size_t delta_bytes = delta_size(len, width);
+
+    encoded *enc;
+    if (sorted && delta_bytes < rle_bytes) {
+        if (sizeof(encoded) + delta_bytes >= raw_size) {
+            return NULL;
+        }
+        enc = encode_delta(nums, len, width);
+    } else {
+        if (sizeof(encoded) + rle_bytes >= raw_size) {
+            return NULL;
+        }
+        enc = encode_rle(nums, len, nruns);
+    }
+
+    if (enc != NULL) {
+        enc->len = len;
+        enc->min = min;
+        enc->max = max;
+        enc->sum = sum;
+    }
+
+    return enc;
+}
+
+void encoded_decode(const encoded *enc, value *nums) {
+    if (enc->type == RLE) {
+        for (size_t run = 0; run < enc->data.rle.nruns; run++) {
+            value val = enc->data.rle.values[run];
+            unsigned count = enc->data.rle.counts[run];
+            for (unsigned i = 0; i < count; i++) {
+                nums[i] = val;
+            }
+            nums += count;
+        }
+    } else {
+        uvalue cur = enc->data.delta.first;
+        nums[0] = cur;
+        for (size_t i = 1; i < enc->len; i++) {
+            cur += delta_at(enc, i - 1);
+            nums[i] = cur;
+        }
+    }
+}
+
+value encoded_get(const encoded *enc, size_t idx) {
+    if (enc->type == RLE) {
+        /* The last stride starting at or before the index holds its run. */
+        const uint32_t *starts = enc->data.rle.starts;
+        size_t lo = 0, hi = strides(enc->data.rle.nruns);
+        while (hi - lo > 1) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (starts[mid] <= idx) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        size_t run = lo * STRIDE;
+        idx -= starts[lo];
+        while (idx >= enc->data.rle.counts[run]) {
+            idx -= enc->data.rle.counts[run];
+            run++;
+        }
+        return enc->data.rle.values[run];
+    }
+
+    size_t mark = idx / STRIDE;
+    uvalue cur = enc->data.delta.marks[mark];
+    for (size_t i = mark * STRIDE; i < idx; i++) {
+        cur += delta_at(enc, i);
+    }
+
+    return cur;
+}
+
+static int ranks_below(value cur, value num, int inclusive) {
+    return cur < num || (inclusive && cur == num);
+}
+
+size_t encoded_rank(const encoded *enc, value num, int inclusive) {
+    if (enc->type == RLE) {
+        const value *values = enc->data.rle.values;
+        size_t nruns = enc->data.rle.nruns;
+        /* Finds the last stride whose first run still ranks below. */
+        size_t lo = 0, hi = strides(nruns);
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (ranks_below(values[mid * STRIDE], num, inclusive)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == 0) {
+            return 0;
+        }
+        size_t run = (lo - 1) * STRIDE;
+        size_t rank = enc->data.rle.starts[lo - 1];
+        while (run < nruns && ranks_below(values[run], num, inclusive)) {
+            rank += enc->data.rle.counts[run];
+            run++;
+        }
+        return rank;
+    }
+
+    const value *marks = enc->data.delta.marks;
+    size_t lo = 0, hi = strides(enc->len);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ranks_below(marks[mid], num, inclusive)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return 0;
+    }
+    size_t rank = (lo - 1) * STRIDE;
+    uvalue cur = marks[lo - 1];
+    while (ranks_below(cur, num, inclusive) && ++rank < enc->len) {
+        cur += delta_at(enc, rank - 1);
+    }
+
+    return rank;
+}
+
+value encoded_min(const encoded *enc) {
+    return enc->min;
+}
+
+value encoded_max(const encoded *enc) {
+    return enc->max;
+}
+
+total encoded_sum(const encoded *enc) {
+    return enc->sum;
+}
+
+size_t encoded_len(const encoded *enc) {
+    return enc->len;
+}
+
+size_t encoded_size(const encoded *enc) {
+    if (enc->type == RLE) {
+        return sizeof(encoded) + rle_size(enc->data.rle.nruns);
+    }
+
+    return sizeof(encoded) + delta_size(enc->len, enc->data.delta.width);
+}
+
+encoded *encoded_clone(const encoded *enc) {
+    encoded *cpy = (encoded *) malloc(sizeof(encoded));
+    if (cpy == NULL) {
+        return NULL;
+    }
+    memcpy(cpy, enc, sizeof(encoded));
+
+    if (enc->type == RLE) {
+        size_t nruns = enc->data.rle.nruns;
+        cpy->data.rle.values = (value *) malloc(nruns * sizeof(value));
+        cpy->data.rle.counts = (unsigned *) malloc(nruns * sizeof(unsigned));
+        cpy->data.rle.starts = (uint32_t *) malloc(strides(nruns)
+                * sizeof(uint32_t));
+        if (cpy->data.rle.values == NULL || cpy->data.rle.counts == NULL
+                || cpy->data.rle.starts == NULL) {
+            del_encoded(cpy);
+            return NULL;
+        }
+        memcpy(cpy->data.rle.values, enc->data.rle.values,
+                nruns * sizeof(value));
+        memcpy(cpy->data.rle.counts, enc->data.rle.counts,
+                nruns * sizeof(unsigned));
+        memcpy(cpy->data.rle.starts, enc->data.rle.starts,
+                strides(nruns) * sizeof(uint32_t));
+    } else {
+        size_t nwords = enc->data.delta.nwords + 1;
+        size_t nmarks = strides(enc->len);
+        cpy->data.delta.words = (uint64_t *) malloc(nwords * sizeof(uint64_t));
+        cpy->data.delta.marks = (value *) malloc(nmarks * sizeof(value));
+        if (cpy->data.delta.words == NULL || cpy->data.delta.marks == NULL) {
+            del_encoded(cpy);
+            return NULL;
+        }
+        memcpy(cpy->data.delta.words, enc->data.delta.words,
+                nwords * sizeof(uint64_t));
+        memcpy(cpy->data.delta.marks, enc->data.delta.marks,
+                nmarks * sizeof(value));
+    }
+
+    return cpy;
+}
+
+void del_encoded(encoded *enc) {
+    if (enc == NULL) {
+        return;
+    }
+
+    if (enc->type == RLE) {
+        free(enc->data.rle.values);
+        free(enc->data.rle.counts);
+        free(enc->data.rle.starts);
+    } else {
+        free(enc->data.delta.words);
+        free(enc->data.delta.marks);
+    }
+    free(enc);
+}
@@ -0,0 +1,70 @@
+#ifndef ENCODING_H
+#define ENCODING_H
+
+#include <stddef.h>
+
+#include "value.h"
+
+/*
+ * A structure representing a compressed, read-only run of integers. There are
+ * two encodings:
+ * - run-length: each distinct run of repeated values is stored once with its
+ *   repeat count;
+ * - delta: a sorted run is stored as its first value followed by the bit
+ *   packed differences between neighbouring values.
+ * The minimum, maximum, sum and length are recorded when the integers are
+ * encoded, so they can be read without decoding.
+ */
+typedef struct encoded encoded;
+
+/*
+ * Encodes the given integers with whichever encoding is smaller. Returns
+ * `NULL` if neither encoding is smaller than the given raw size in bytes, or
+ * if there is not enough memory.
+ */
+encoded *encode_ints(const value *nums, size_t len, size_t raw_size);
+
+/*
+ * Decodes all integers into the given buffer, which must be able to hold
+ * encoded_len integers.
+ */
+void encoded_decode(const encoded *enc, value *nums);
+
+/*
+ * Returns the integer at the given zero-based index.
+ */
+value encoded_get(const encoded *enc, size_t idx);
+
+/*
+ * Returns the number of integers less than the given one, or also equal to it
+ * when inclusive. The integers must be in ascending order.
+ */
+size_t encoded_rank(const encoded *enc, value num, int inclusive);
+
+/*
+ * Statistics functions.
+ *
+ * Returns the minimum, maximum, sum and length of the encoded integers. None
+ * of them decode the integers.
+ */
+value encoded_min(const encoded *enc);
+value encoded_max(const encoded *enc);
+total encoded_sum(const encoded *enc);
+size_t encoded_len(const encoded *enc);
+
+/*
+ * Returns the number of bytes held by the encoded integers.
+ */
+size_t encoded_size(const encoded *enc);
+
+/*
+ * Creates an independent copy of the encoded integers.
+ */
+encoded *encoded_clone(const encoded *enc);
+
+/*
+ * Deletes the encoded integers and frees all its subsequent memory.
+ */
+void del_encoded(encoded *enc);
+
+#endif
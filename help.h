@@ -4,9 +4,11 @@
 #define HELP_STRING "BYE   clear database and exit\n" \
     "HELP  display this help message\n" \
     "\n" \
-    "LIST KEYS       displays all keys in current state\n" \
-    "LIST ENTRIES    displays all entries in current state\n" \
-    "LIST SNAPSHOTS  displays all snapshots in the database\n" \
+    "LIST KEYS                      displays all keys in current state\n" \
+    "LIST KEYS PREFIX <p>           displays keys starting with p in order\n" \
+    "LIST KEYS [FROM <a>] [TO <b>]  displays keys from a to b in order\n" \
+    "LIST ENTRIES                   displays all entries in current state\n" \
+    "LIST SNAPSHOTS                 displays all snapshots in the database\n" \
     "\n" \
     "GET <key>    displays entry values\n" \
     "DEL <key>    deletes entry from current state\n" \
@@ -16,6 +18,14 @@
     "PUSH <key> <value ...>    pushes values to the front\n" \
     "APPEND <key> <value ...>  appends values to the back\n" \
     "\n" \
+    "MGET <key ...>                     displays entries of several keys\n" \
+    "MSET <key> <value ...> [; ...]     sets several entries at once\n" \
+    "MAPPEND <key> <value ...> [; ...]  appends values to several entries\n" \
+    "\n" \
+    "MULTI    starts queueing commands\n" \
+    "EXEC     runs queued commands, undoing them all if one fails\n" \
+    "DISCARD  drops queued commands\n" \
+    "\n" \
     "PICK <key> <index>   displays value at index\n" \
     "PLUCK <key> <index>  displays and removes value at index\n" \
     "POP <key>            displays and removes the front value\n" \
@@ -24,18 +34,72 @@
     "ROLLBACK <id>  restores to snapshot and deletes newer snapshots\n" \
     "CHECKOUT <id>  replaces current state with a copy of snapshot\n" \
     "SNAPSHOT       saves the current state as a snapshot\n" \
+    "GC             displays memory of deleted snapshots not yet freed\n" \
+    "GC RUN         frees all memory of deleted snapshots now\n" \
+    "GC LIMIT <n>   frees memory of deleted snapshots beyond cost n\n" \
+    "\n" \
+    "RETAIN                  displays snapshot retention policy\n" \
+    "RETAIN LAST <n>|ALL     keeps the newest n snapshots\n" \
+    "RETAIN EVERY <s>|NONE   keeps the newest snapshot of every s seconds\n" \
+    "RETAIN COST <n>|NONE    deletes oldest snapshots beyond cost n\n" \
+    "\n" \
+    "<read command> AT <id>  reads snapshot instead of current state\n" \
+    "\n" \
+    "SAVE <id> <path>     writes snapshot to file in the background\n" \
+    "BGSAVE <path>        writes current state to file in the background\n" \
+    "LASTSAVE             displays progress of the latest save\n" \
+    "LOAD <path>          sets and appends entries from a dump file\n" \
+    "PUBLISH <id> [name]  lays out snapshot in shared memory for readers\n" \
+    "IMAGE <name> [key]   reads keys or entry values from a published image\n" \
+    "REPLICATION          displays replication role and progress\n" \
     "\n" \
     "MIN <key>  displays minimum value\n" \
     "MAX <key>  displays maximum value\n" \
     "SUM <key>  displays sum of values\n" \
     "LEN <key>  displays number of values\n" \
+    "FLATTEN <key>  displays values with sub-entries expanded\n" \
     "\n" \
     "REV <key>   reverses order of values (simple entry only)\n" \
     "UNIQ <key>  removes repeated adjacent values (simple entry only)\n" \
     "SORT <key>  sorts values in ascending order (simple entry only)\n" \
     "\n" \
+    "RANK <key> <value>        displays number of values less than value\n" \
+    "COUNT <key> <low> <high>  displays number of values in the range\n" \
+    "CONTAINS <key> <value>    displays if the value is in the entry\n" \
+    "PERCENTILE <key> <p>      displays the p-th percentile value\n" \
+    "DISTINCT <key>            displays number of distinct values\n" \
+    "QUANTILE <key> <q>        displays the value at fraction q from 0 to 1\n" \
+    "SKETCH <key> ON|OFF       keeps sketches estimating DISTINCT and QUANTILE\n" \
+    "\n" \
+    "ADD <key> <value>              adds value to every value (simple entry only)\n" \
+    "MUL <key> <value>              multiplies every value (simple entry only)\n" \
+    "CLAMP <key> <low> <high>       limits every value to the range\n" \
+    "FILTER <key> GT|LT|EQ <value>  keeps values comparing so to value\n" \
+    "\n" \
+    "UNION <key> <key> ...      sets first key to distinct values in any other\n" \
+    "INTERSECT <key> <key> ...  sets first key to distinct values in all others\n" \
+    "DIFF <key> <key> ...       sets first key to values of second not in the rest\n" \
+    "\n" \
     "FORWARD <key> lists all the forward references of this key\n" \
     "BACKWARD <key> lists all the backward references of this key\n" \
-    "TYPE <key> displays if the entry of this key is simple or general\n"
+    "REACH <key> displays the number of keys reachable forward and backward\n" \
+    "PATH <key> <key> lists the shortest chain of references between keys\n" \
+    "DEPTH <key> displays the length of the longest chain of references\n" \
+    "TOPO lists all keys with referenced keys before referencing keys\n" \
+    "\n" \
+    "MEMORY <key>            displays bytes held by the entry\n" \
+    "MEMORY SNAPSHOT <id>    displays bytes held by the snapshot\n" \
+    "MEMORY TOP [n]          lists the n entries holding the most bytes\n" \
+    "MEMORY TOTAL            displays bytes held by each part of the database\n" \
+    "TYPE <key> displays if the entry of this key is simple or general\n" \
+    "\n" \
+    "INDEX ON|OFF       turns the value index on or off\n" \
+    "FIND <value>       lists keys containing the value\n" \
+    "FIND <low> <high>  lists keys containing a value in the range\n" \
+    "\n" \
+    "SLOWLOG                      lists commands that took at least the threshold\n" \
+    "SLOWLOG LEN                  displays number of logged commands\n" \
+    "SLOWLOG RESET                clears logged commands\n" \
+    "SLOWLOG THRESHOLD <us>|NONE  logs commands taking at least us microseconds\n"
 
 #endif
@@ -0,0 +1,159 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+
+struct image {
+    image_header *head;
+    size_t size;
+};
+
+size_t image_size(size_t nkeys, size_t nrefs, size_t nvalues) {
+    return sizeof(image_header) + nkeys * sizeof(image_key)
+        + nrefs * sizeof(image_ref) + nvalues * sizeof(value);
+}
+
+image_key *image_keys(image_header *head) {
+    return (image_key *) (head + 1);
+}
+
+image_ref *image_refs(image_header *head) {
+    return (image_ref *) (image_keys(head) + head->nkeys);
+}
+
+value *image_values(image_header *head) {
+    return (value *) (image_refs(head) + head->nrefs);
+}
+
+image_header *image_create(const char *name, size_t size) {
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    void *base = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    image_header *head = (image_header *) base;
+    head->size = size;
+
+    return head;
+}
+
+void image_seal(image_header *head) {
+    memcpy(head->magic, IMAGE_MAGIC, sizeof(head->magic));
+    head->width = sizeof(value);
+
+    /* The version is zero until the rest of the image is written. */
+    __atomic_store_n(&head->version, IMAGE_VERSION, __ATOMIC_RELEASE);
+    munmap(head, head->size);
+}
+
+image *image_open(const char *name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(image_header)) {
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    image_header *head = (image_header *) base;
+    if (__atomic_load_n(&head->version, __ATOMIC_ACQUIRE) != IMAGE_VERSION
+            || memcmp(head->magic, IMAGE_MAGIC, sizeof(head->magic)) != 0
+            || head->width != sizeof(value)
+            || head->size != (size_t) st.st_size
+            || image_size(head->nkeys, head->nrefs, head->nvalues)
+                != head->size) {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+
+    image *img = (image *) malloc(sizeof(image));
+    if (img == NULL) {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    img->head = head;
+    img->size = st.st_size;
+
+    return img;
+}
+
+size_t image_snapshot(const image *img) {
+    return img->head->snapshot;
+}
+
+long long image_taken(const image *img) {
+    return img->head->taken;
+}
+
+size_t image_len(const image *img) {
+    return img->head->nkeys;
+}
+
+int image_find(const image *img, const char *key, size_t *idx) {
+    const image_key *keys = image_keys(img->head);
+    size_t lo = 0, hi = img->head->nkeys;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strncmp(keys[mid].key, key, IMAGE_KEYLEN);
+        if (cmp == 0) {
+            *idx = mid;
+            return 1;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return 0;
+}
+
+const char *image_name(const image *img, size_t idx) {
+    return image_keys(img->head)[idx].key;
+}
+
+const value *image_ints(const image *img, size_t idx, size_t *lenp) {
+    const image_key *key = &image_keys(img->head)[idx];
+    *lenp = key->nvalues;
+
+    return image_values(img->head) + key->values;
+}
+
+const image_ref *image_links(const image *img, size_t idx, size_t *lenp) {
+    const image_key *key = &image_keys(img->head)[idx];
+    *lenp = key->nrefs;
+
+    return image_refs(img->head) + key->refs;
+}
+
+void image_close(image *img) {
+    if (img == NULL) {
+        return;
+    }
+
+    munmap(img->head, img->size);
+    free(img);
+}
@@ -0,0 +1,124 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "value.h"
+
+/*
+ * An image is a snapshot laid out in a POSIX shared memory segment by
+ * `PUBLISH`, for other processes on the same host to read while the database
+ * keeps changing. It holds no pointers, only offsets from its start, so it can
+ * be mapped at any address:
+ *
+ *     header | keys | references | values
+ *
+ * Keys are sorted, and each one holds where its integers and references are.
+ * The integers of an entry are contiguous and in order. A reference names the
+ * key it points to by index, and its position among the entry's elements, so
+ * the element list is the integers with the references inserted at their
+ * positions. An image never changes once published, so it is read without
+ * copies or locks.
+ */
+
+#define IMAGE_MAGIC "IDBIMAGE"
+#define IMAGE_VERSION (1)
+#define IMAGE_KEYLEN (16)
+
+typedef struct image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint64_t snapshot;
+    uint64_t taken;
+    uint64_t nkeys;
+    uint64_t nrefs;
+    uint64_t nvalues;
+    uint64_t size;
+} image_header;
+
+typedef struct image_key {
+    char key[IMAGE_KEYLEN];
+    uint64_t values;
+    uint64_t nvalues;
+    uint64_t refs;
+    uint64_t nrefs;
+} image_key;
+
+typedef struct image_ref {
+    uint64_t pos;
+    uint64_t key;
+} image_ref;
+
+/*
+ * A mapped image opened for reading.
+ */
+typedef struct image image;
+
+/*
+ * Layout functions.
+ *
+ * - size: returns the number of bytes of an image of the given counts;
+ * - keys, refs, values: return the start of each table of an image.
+ */
+size_t image_size(size_t nkeys, size_t nrefs, size_t nvalues);
+image_key *image_keys(image_header *head);
+image_ref *image_refs(image_header *head);
+value *image_values(image_header *head);
+
+/*
+ * Creates a new shared memory segment of the given name and size, replacing
+ * any of that name, and maps it for writing. Readers that already have the
+ * replaced segment open keep reading it. Returns the mapping, or `NULL` if
+ * unsuccessful.
+ */
+image_header *image_create(const char *name, size_t size);
+
+/*
+ * Marks a created image as complete, so that it can be opened, and unmaps it.
+ */
+void image_seal(image_header *head);
+
+/*
+ * Opens a published image by the name of its segment. Returns `NULL` if there
+ * is no such segment, or it is not a complete image of values of this width.
+ */
+image *image_open(const char *name);
+
+/*
+ * Header functions.
+ *
+ * - snapshot: returns the ID of the snapshot in the image;
+ * - taken: returns when the snapshot was taken;
+ * - len: returns the number of keys.
+ */
+size_t image_snapshot(const image *img);
+long long image_taken(const image *img);
+size_t image_len(const image *img);
+
+/*
+ * Finds a key by binary search, storing its index in the result pointer.
+ * Returns 1 if found, 0 otherwise.
+ */
+int image_find(const image *img, const char *key, size_t *idx);
+
+/*
+ * Key functions. Each takes the index of a key.
+ *
+ * - name: returns the key;
+ * - ints: returns the integers of the key in order, storing how many in the
+ *   result pointer;
+ * - links: returns the references of the key in order, storing how many in
+ *   the result pointer.
+ */
+const char *image_name(const image *img, size_t idx);
+const value *image_ints(const image *img, size_t idx, size_t *lenp);
+const image_ref *image_links(const image *img, size_t idx, size_t *lenp);
+
+/*
+ * Unmaps an image. Anything returned from it is no longer valid.
+ */
+void image_close(image *img);
+
+#endif
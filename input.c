@@ -0,0 +1,170 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "input.h"
+
+#define INPUTLEN (1024)
+#define QUEUELEN (256)
+#define READLEN (65536)
+
+/*
+ * A slot of the queue. Its sequence is its position when it is free to be
+ * written, and one past its position when it holds a line to be taken.
+ */
+struct slot {
+    atomic_size_t seq;
+    char line[INPUTLEN];
+};
+
+static struct slot queue[QUEUELEN];
+static atomic_size_t head = 0;
+static size_t tail = 0;
+
+static atomic_int ended = 0;
+static atomic_int sleeping = 0;
+static int wake[2] = { -1, -1 };
+
+static int reader_fd = -1;
+
+static void input_wake() {
+    if (atomic_exchange(&sleeping, 0)) {
+        while (write(wake[1], "", 1) < 0 && errno == EINTR);
+    }
+}
+
+static void input_push(const char *line, size_t len) {
+    size_t pos = atomic_load(&head);
+    struct slot *slot;
+    while (1) {
+        slot = &queue[pos % QUEUELEN];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak(&head, &pos, pos + 1)) {
+                break;
+            }
+        } else if (seq < pos) {
+            /* The queue is full until the executor takes a line. */
+            sched_yield();
+            pos = atomic_load(&head);
+        } else {
+            pos = atomic_load(&head);
+        }
+    }
+
+    memcpy(slot->line, line, len);
+    slot->line[len] = '\0';
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    input_wake();
+}
+
+int input_pending() {
+    struct slot *slot = &queue[tail % QUEUELEN];
+
+    return atomic_load_explicit(&slot->seq, memory_order_acquire) == tail + 1
+        || atomic_load(&ended);
+}
+
+static void *input_run(void *arg) {
+    static char chunk[READLEN];
+    char line[INPUTLEN];
+    size_t len = 0;
+
+    ssize_t n;
+    while ((n = read(reader_fd, chunk, READLEN)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            if (chunk[i] == '\n') {
+                input_push(line, len);
+                len = 0;
+                continue;
+            }
+            line[len++] = chunk[i];
+            if (len == INPUTLEN - 1) {
+                input_push(line, len);
+                len = 0;
+            }
+        }
+    }
+    if (len > 0) {
+        input_push(line, len);
+    }
+
+    atomic_store(&ended, 1);
+    input_wake();
+
+    return NULL;
+}
+
+int input_start(int fd) {
+    for (size_t i = 0; i < QUEUELEN; i++) {
+        atomic_init(&queue[i].seq, i);
+    }
+    if (pipe(wake) != 0) {
+        return 0;
+    }
+    fcntl(wake[0], F_SETFL, fcntl(wake[0], F_GETFL) | O_NONBLOCK);
+
+    reader_fd = fd;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, input_run, NULL) != 0) {
+        return 0;
+    }
+    pthread_detach(thread);
+
+    return 1;
+}
+
+int input_wait(int other) {
+    struct pollfd fds[2] = {
+        { wake[0], POLLIN, 0 },
+        { other, POLLIN, 0 }
+    };
+
+    while (!input_pending()) {
+        atomic_store(&sleeping, 1);
+        if (input_pending()) {
+            atomic_store(&sleeping, 0);
+            break;
+        }
+
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            return 1;
+        }
+        char drain[16];
+        while (read(wake[0], drain, sizeof(drain)) > 0);
+        atomic_store(&sleeping, 0);
+
+        if (fds[1].revents != 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int input_pop(char *buf, size_t size) {
+    while (!input_wait(-1));
+
+    struct slot *slot = &queue[tail % QUEUELEN];
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != tail + 1) {
+        return 0;
+    }
+
+    strncpy(buf, slot->line, size - 1);
+    buf[size - 1] = '\0';
+    atomic_store_explicit(&slot->seq, tail + QUEUELEN, memory_order_release);
+    tail++;
+
+    return 1;
+}
@@ -0,0 +1,38 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stddef.h>
+
+/*
+ * Input is read on its own thread while commands are executed. The reader
+ * splits what it reads into lines and adds them to a bounded lock-free queue,
+ * which the executing thread takes lines from in order. A line longer than the
+ * buffer is split in the same way as `fgets` would split it.
+ */
+
+/*
+ * Starts the thread reading lines from the given file descriptor. Returns 1 if
+ * successful, 0 otherwise.
+ */
+int input_start(int fd);
+
+/*
+ * Returns 1 if a line can be taken or the input has ended, 0 otherwise.
+ */
+int input_pending();
+
+/*
+ * Waits until there is a line to take, the input has ended, or the other file
+ * descriptor is readable. A negative file descriptor is ignored. Returns 1 if
+ * a line can be taken or the input has ended, 0 if the other file descriptor
+ * is readable.
+ */
+int input_wait(int other);
+
+/*
+ * Takes the next line into the buffer without its newline, waiting for it if
+ * necessary. Returns 1 if successful, 0 if the input has ended.
+ */
+int input_pop(char *buf, size_t size);
+
+#endif
@@ -4,18 +4,47 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "darray.h"
 
+#include "encoding.h"
 #include "help.h"
+#include "image.h"
+#include "input.h"
 #include "integerdb.h"
+#include "replica.h"
+#include "sketch.h"
+#include "trace.h"
+#include "value.h"
+#include "wire.h"
 
 #define KEYLEN (16)
 #define BUFLEN (1024)
+#define PACKLEN (16)
+#define MAXTHREADS (64)
+#define CLONEMIN (1024)
+#define GCSTEP (4096)
+#define DARRAYBYTES (32)
+#define TOPLEN (10)
+#define LOADMIN (1 << 20)
+#define SLOWLEN (128)
+#define SLOWLINELEN (128)
+#define SLOWMICROS (10000)
 #define WHITESPACE " \t\r\n\v\f"
 
 /* Pointer helper functions */
@@ -30,30 +59,62 @@ void *clone_ptr(const void *p) {
     return (void *) p;
 }
 
+/* Errors */
+
+int command_failed = 0;
+
+void command_error(const char *message) {
+    printf("%s\n", message);
+    command_failed = 1;
+}
+
 /* Database */
 
 struct element {
     enum ele_type type;
     union {
-        int num;
+        value num;
         struct entry *entry;
     } value;
 };
 
+struct stats {
+    value min;
+    value max;
+    total sum;
+    size_t len;
+    int overflow;
+};
+
 struct entry {
     char key[KEYLEN];
     darray *elements;
     darray *forward;
     darray *backward;
+    encoded *packed;
+    size_t stamp;
+    size_t cursor;
+    size_t depth;
+    stats memo;
+    entry *copy;
+    int sorted;
+    sketch *sketch;
 };
 
 struct snapshot {
     size_t id;
+    time_t taken;
     darray *entries;
+    darray *keys;
 };
 
-element *new_int_ele(int num) {
+/* Work done by the running command on this thread, for the slow log. */
+__thread size_t slow_touched = 0;
+__thread size_t slow_allocs = 0;
+
+element *new_int_ele(value num) {
     element *ele = (element *) malloc(sizeof(element));
+    slow_allocs++;
     if (ele != NULL) {
         ele->type = INTEGER;
         ele->value.num = num;
@@ -64,6 +125,7 @@ element *new_int_ele(int num) {
 
 element *new_ent_ele(entry *ent) {
     element *ele = (element *) malloc(sizeof(element));
+    slow_allocs++;
     if (ele != NULL) {
         ele->type = ENTRY;
         ele->value.entry = ent;
@@ -79,7 +141,7 @@ void element_print(element *ele) {
     }
     switch (ele->type) {
         case INTEGER:
-            printf("%d", ele->value.num);
+            printf(VALUE_FMT, ele->value.num);
             break;
         case ENTRY:
             printf("%s", ele->value.entry->key);
@@ -89,16 +151,38 @@ void element_print(element *ele) {
     }
 }
 
+void total_print(total sum) {
+    char digits[VALUELEN];
+    size_t len = 0;
+    int negative = sum < 0;
+    do {
+        int digit = sum % 10;
+        digits[len++] = '0' + (negative ? -digit : digit);
+        sum /= 10;
+    } while (sum != 0);
+
+    if (negative) {
+        putchar('-');
+    }
+    while (len > 0) {
+        putchar(digits[--len]);
+    }
+}
+
 int element_int_cmp(const element *ele1, const element *ele2) {
-    int num1 = ele1->value.num;
-    int num2 = ele2->value.num;
+    value num1 = ele1->value.num;
+    value num2 = ele2->value.num;
     if (num1 < num2) { return -1; }
     if (num1 > num2) { return 1; }
     return 0;
 }
 
-void element_agg_min(const element *ele, int *min) {
-    int val;
+int value_cmp(const value *num1, const value *num2) {
+    return (*num1 > *num2) - (*num1 < *num2);
+}
+
+void element_agg_min(const element *ele, value *min) {
+    value val;
     if (ele->type == INTEGER) {
         val = ele->value.num;
     } else {
@@ -109,8 +193,8 @@ void element_agg_min(const element *ele, int *min) {
     }
 }
 
-void element_agg_max(const element *ele, int *max) {
-    int val;
+void element_agg_max(const element *ele, value *max) {
+    value val;
     if (ele->type == INTEGER) {
         val = ele->value.num;
     } else {
@@ -121,7 +205,7 @@ void element_agg_max(const element *ele, int *max) {
     }
 }
 
-void element_agg_sum(const element *ele, long long *sum) {
+void element_agg_sum(const element *ele, total *sum) {
     if (ele->type == INTEGER) {
         *sum += ele->value.num;
     } else {
@@ -149,12 +233,17 @@ element *element_find_copy(element *ele) {
 
 entry *new_entry(char *key) {
     entry *ent = (entry *) malloc(sizeof(entry));
+    slow_allocs++;
 
     if (ent != NULL) {
         strncpy(ent->key, key, KEYLEN - 1);
         ent->elements = new_darray(free);
         ent->forward = new_darray(NULL);
         ent->backward = new_darray(NULL);
+        ent->packed = NULL;
+        ent->stamp = 0;
+        ent->sorted = 0;
+        ent->sketch = NULL;
     }
 
     return ent;
@@ -165,6 +254,19 @@ void entry_print_key(entry *ent) {
 }
 
 void entry_print_nokey(entry *ent) {
+    if (ent->packed != NULL) {
+        size_t len = encoded_len(ent->packed);
+        value *nums = (value *) malloc(len * sizeof(value));
+        encoded_decode(ent->packed, nums);
+        printf("[" VALUE_FMT, nums[0]);
+        for (size_t i = 1; i < len; i++) {
+            printf(" " VALUE_FMT, nums[i]);
+        }
+        printf("]\n");
+        free(nums);
+        return;
+    }
+
     printf("[");
     if (darray_len(ent->elements) != 0) {
         element_print(darray_get(ent->elements, 0));
@@ -185,6 +287,67 @@ int entry_is_simple(entry *ent) {
     return darray_len(ent->forward) == 0;
 }
 
+void entry_pack(entry *ent) {
+    size_t len = darray_len(ent->elements);
+    if (ent->packed != NULL || len < PACKLEN || !entry_is_simple(ent)) {
+        return;
+    }
+
+    value *nums = (value *) malloc(len * sizeof(value));
+    if (nums == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < len; i++) {
+        element *ele = darray_get(ent->elements, i);
+        nums[i] = ele->value.num;
+    }
+
+    ent->packed = encode_ints(nums, len,
+            len * (sizeof(element) + sizeof(element *)));
+    if (ent->packed != NULL) {
+        darray_clear(ent->elements);
+    }
+    free(nums);
+}
+
+void entry_unpack(entry *ent) {
+    if (ent->packed == NULL) {
+        return;
+    }
+
+    size_t len = encoded_len(ent->packed);
+    value *nums = (value *) malloc(len * sizeof(value));
+    if (nums == NULL) {
+        return;
+    }
+    encoded_decode(ent->packed, nums);
+    for (size_t i = 0; i < len; i++) {
+        darray_append(ent->elements, new_int_ele(nums[i]));
+    }
+    free(nums);
+
+    del_encoded(ent->packed);
+    ent->packed = NULL;
+}
+
+void entry_clear(entry *ent) {
+    darray_clear(ent->elements);
+    del_encoded(ent->packed);
+    ent->packed = NULL;
+    ent->sorted = 0;
+    if (ent->sketch != NULL) {
+        sketch_clear(ent->sketch);
+    }
+}
+
+size_t entry_count(entry *ent) {
+    if (ent->packed != NULL) {
+        return encoded_len(ent->packed);
+    }
+
+    return darray_len(ent->elements);
+}
+
 int entry_has_key(const entry *ent, const char *key) {
     return strcmp(ent->key, key);
 }
@@ -194,20 +357,9 @@ int entry_key_cmp(const entry *ent1, const entry *ent2) {
 }
 
 void entry_add_ref(entry *ent1, entry *ent2) {
+    TRACE2(ref__add, ent1->key, ent2->key);
     darray_append(ent1->forward, ent2);
-    darray_extend(ent1->forward, ent2->forward);
-    for (size_t i = 0; i < darray_len(ent1->backward); i++) {
-        entry *ent = darray_get(ent1->backward, i);
-        darray_append(ent->forward, ent2);
-        darray_extend(ent->forward, ent2->forward);
-    }
     darray_append(ent2->backward, ent1);
-    darray_extend(ent2->backward, ent1->backward);
-    for (size_t i = 0; i < darray_len(ent2->forward); i++) {
-        entry *ent = darray_get(ent2->forward, i);
-        darray_append(ent->backward, ent1);
-        darray_extend(ent->backward, ent1->backward);
-    }
 }
 
 int _compare_voidp(const void *p1, const void *p2) {
@@ -229,31 +381,13 @@ int darray_pop_exact(darray *arrp, void *itemp) {
 }
 
 void entry_del_ref(entry *ent1, entry *ent2) {
+    TRACE2(ref__del, ent1->key, ent2->key);
     darray_pop_exact(ent1->forward, ent2);
-    for (size_t j = 0; j < darray_len(ent2->forward); j++) {
-        darray_pop_exact(ent1->forward, darray_get(ent2->forward, j));
-    }
-    for (size_t i = 0; i < darray_len(ent1->backward); i++) {
-        entry *enti = darray_get(ent1->backward, i);
-        darray_pop_exact(enti->forward, ent2);
-        for (size_t j = 0; j < darray_len(ent2->forward); j++) {
-            darray_pop_exact(enti->forward, darray_get(ent2->forward, j));
-        }
-    }
     darray_pop_exact(ent2->backward, ent1);
-    for (size_t j = 0; j < darray_len(ent1->backward); j++) {
-        darray_pop_exact(ent2->backward, darray_get(ent1->backward, j));
-    }
-    for (size_t i = 0; i < darray_len(ent2->forward); i++) {
-        entry *enti = darray_get(ent2->forward, i);
-        darray_pop_exact(enti->backward, ent1);
-        for (size_t j = 0; j < darray_len(ent1->backward); j++) {
-            darray_pop_exact(enti->backward, darray_get(ent1->backward, j));
-        }
-    }
 }
 
 void entry_ref_all(entry *ent, darray *elements) {
+    slow_touched += darray_len(elements);
     for (size_t i = 0; i < darray_len(elements); i++) {
         element *ele = darray_get(elements, i);
         if (ele->type == ENTRY) {
@@ -263,72 +397,574 @@ void entry_ref_all(entry *ent, darray *elements) {
 }
 
 void entry_deref_all(entry *ent) {
-    for (size_t i = 0; i < darray_len(ent->forward); i++) {
-        entry_del_ref(ent, darray_get(ent->forward, i));
+    slow_touched += darray_len(ent->elements);
+    for (size_t i = 0; i < darray_len(ent->elements); i++) {
+        element *ele = darray_get(ent->elements, i);
+        if (ele->type == ENTRY) {
+            entry_del_ref(ent, ele->value.entry);
+        }
+    }
+}
+
+size_t generation = 0;
+
+void stats_merge(stats *st, const stats *other) {
+    if (other->min < st->min) { st->min = other->min; }
+    if (other->max > st->max) { st->max = other->max; }
+    st->overflow |= other->overflow
+        || __builtin_add_overflow(st->sum, other->sum, &st->sum);
+    st->len += other->len;
+}
+
+void entry_visit(entry *ent, darray *stack) {
+    ent->stamp = generation;
+    ent->cursor = 0;
+    ent->memo.min = VALUE_MAX;
+    ent->memo.max = VALUE_MIN;
+    ent->memo.sum = 0;
+    ent->memo.len = 0;
+    ent->memo.overflow = 0;
+    if (ent->packed != NULL) {
+        ent->memo.min = encoded_min(ent->packed);
+        ent->memo.max = encoded_max(ent->packed);
+        ent->memo.sum = encoded_sum(ent->packed);
+        ent->memo.len = encoded_len(ent->packed);
     }
+    darray_append(stack, ent);
 }
 
-int entry_min(entry *ent) {
-    int min = INT_MAX;
-    darray_aggregate(ent->elements, &min, (aggregate) element_agg_min);
+stats entry_stats(entry *ent) {
+    darray *stack = new_darray(NULL);
+
+    generation++;
+    entry_visit(ent, stack);
+    while (darray_len(stack) != 0) {
+        entry *top = darray_get(stack, darray_len(stack) - 1);
+        element *ele = darray_get(top->elements, top->cursor++);
+        slow_touched++;
+        if (ele == NULL) {
+            /* The stamp stays, and the cursor marks the memo as complete. */
+            top->cursor = SIZE_MAX;
+            darray_pop(stack, darray_len(stack) - 1);
+            if (darray_len(stack) != 0) {
+                entry *parent = darray_get(stack, darray_len(stack) - 1);
+                stats_merge(&parent->memo, &top->memo);
+            }
+        } else if (ele->type == INTEGER) {
+            stats single = { ele->value.num, ele->value.num, ele->value.num,
+                1, 0 };
+            stats_merge(&top->memo, &single);
+        } else if (ele->value.entry->stamp != generation) {
+            entry_visit(ele->value.entry, stack);
+        } else if (ele->value.entry->cursor == SIZE_MAX) {
+            stats_merge(&top->memo, &ele->value.entry->memo);
+        }
+    }
+    del_darray(stack);
 
-    return min;
+    return ent->memo;
 }
 
-int entry_max(entry *ent) {
-    int max = INT_MIN;
-    darray_aggregate(ent->elements, &max, (aggregate) element_agg_max);
+value entry_min(entry *ent) {
+    if (ent->sorted && ent->packed == NULL && darray_len(ent->elements) != 0) {
+        element *ele = darray_get(ent->elements, 0);
+        return ele->value.num;
+    }
 
-    return max;
+    return entry_stats(ent).min;
 }
 
-long long entry_sum(entry *ent) {
-    long long sum = 0;
-    darray_aggregate(ent->elements, &sum, (aggregate) element_agg_sum);
+value entry_max(entry *ent) {
+    size_t len = darray_len(ent->elements);
+    if (ent->sorted && ent->packed == NULL && len != 0) {
+        element *ele = darray_get(ent->elements, len - 1);
+        return ele->value.num;
+    }
+
+    return entry_stats(ent).max;
+}
 
-    return sum;
+total entry_sum(entry *ent) {
+    return entry_stats(ent).sum;
 }
 
 size_t entry_len(entry *ent) {
-    size_t len = 0;
-    darray_aggregate(ent->elements, &len, (aggregate) element_agg_len);
+    return entry_stats(ent).len;
+}
+
+value *entry_nums(entry *ent) {
+    size_t len = entry_count(ent);
+    slow_touched += len;
+    value *nums = (value *) malloc((len == 0 ? 1 : len) * sizeof(value));
+    if (nums == NULL) {
+        return NULL;
+    }
+
+    if (ent->packed != NULL) {
+        encoded_decode(ent->packed, nums);
+    } else {
+        for (size_t i = 0; i < len; i++) {
+            element *ele = darray_get(ent->elements, i);
+            nums[i] = ele->value.num;
+        }
+    }
+
+    return nums;
+}
+
+size_t entry_rank(entry *ent, value num, int inclusive) {
+    size_t len = entry_count(ent);
+    if (ent->sorted && ent->packed != NULL) {
+        return encoded_rank(ent->packed, num, inclusive);
+    } else if (ent->sorted) {
+        size_t lo = 0, hi = len;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            element *ele = darray_get(ent->elements, mid);
+            if (ele->value.num < num || (inclusive && ele->value.num == num)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    value *nums = entry_nums(ent);
+    size_t rank = 0;
+    if (nums == NULL) {
+        return 0;
+    } else {
+        for (size_t i = 0; i < len; i++) {
+            rank += nums[i] < num || (inclusive && nums[i] == num);
+        }
+    }
+    free(nums);
+
+    return rank;
+}
+
+value nums_select(value *nums, size_t len, size_t k) {
+    size_t lo = 0, hi = len - 1;
+    while (lo < hi) {
+        /* Partitions around the median of the first, middle and last. */
+        size_t mid = lo + (hi - lo) / 2;
+        value a = nums[lo], b = nums[mid], c = nums[hi];
+        value pivot = a < b ? (b < c ? b : (a < c ? c : a))
+            : (a < c ? a : (b < c ? c : b));
+        size_t i = lo, j = hi;
+        while (i <= j) {
+            while (nums[i] < pivot) {
+                i++;
+            }
+            while (nums[j] > pivot) {
+                j--;
+            }
+            if (i <= j) {
+                value tmp = nums[i];
+                nums[i] = nums[j];
+                nums[j] = tmp;
+                i++;
+                if (j-- == 0) {
+                    break;
+                }
+            }
+        }
+        if (k <= j && j != SIZE_MAX) {
+            hi = j;
+        } else if (k >= i) {
+            lo = i;
+        } else {
+            break;
+        }
+    }
+
+    return nums[k];
+}
+
+value entry_select(entry *ent, size_t k) {
+    if (ent->sorted && ent->packed != NULL) {
+        return encoded_get(ent->packed, k);
+    } else if (ent->sorted) {
+        element *ele = darray_get(ent->elements, k);
+        return ele->value.num;
+    }
+
+    value *nums = entry_nums(ent);
+    if (nums == NULL) {
+        return 0;
+    }
+    value num = nums_select(nums, entry_count(ent), k);
+    free(nums);
+
+    return num;
+}
+
+size_t nums_unique(value *nums, size_t len) {
+    size_t kept = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (kept == 0 || nums[i] != nums[kept - 1]) {
+            nums[kept++] = nums[i];
+        }
+    }
+
+    return kept;
+}
+
+size_t nums_gallop(const value *nums, size_t len, size_t lo, value num) {
+    /* Doubles the step until past the integer, then bisects the last step. */
+    size_t step = 1, hi = lo;
+    while (hi < len && nums[hi] < num) {
+        lo = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    if (hi > len) {
+        hi = len;
+    }
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (nums[mid] < num) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+size_t nums_union(const value *a, size_t alen, const value *b, size_t blen,
+        value *out) {
+    size_t i = 0, j = 0, len = 0;
+    while (i < alen && j < blen) {
+        if (a[i] < b[j]) {
+            out[len++] = a[i++];
+        } else if (b[j] < a[i]) {
+            out[len++] = b[j++];
+        } else {
+            out[len++] = a[i++];
+            j++;
+        }
+    }
+    memcpy(out + len, a + i, (alen - i) * sizeof(value));
+    len += alen - i;
+    memcpy(out + len, b + j, (blen - j) * sizeof(value));
+    len += blen - j;
 
     return len;
 }
 
-entry *entry_empty_copy(entry *ent) {
-    entry *cpy = (entry *) malloc(sizeof(entry));
-    strcpy(cpy->key, ent->key);
+size_t nums_intersect(const value *a, size_t alen, const value *b,
+        size_t blen, value *out) {
+    if (alen > blen) {
+        return nums_intersect(b, blen, a, alen, out);
+    }
 
-    return cpy;
+    size_t j = 0, len = 0;
+    for (size_t i = 0; i < alen && j < blen; i++) {
+        j = nums_gallop(b, blen, j, a[i]);
+        if (j < blen && b[j] == a[i]) {
+            out[len++] = a[i];
+        }
+    }
+
+    return len;
+}
+
+size_t nums_diff(const value *a, size_t alen, const value *b, size_t blen,
+        value *out) {
+    size_t j = 0, len = 0;
+    for (size_t i = 0; i < alen; i++) {
+        j = nums_gallop(b, blen, j, a[i]);
+        if (j == blen || b[j] != a[i]) {
+            out[len++] = a[i];
+        }
+    }
+
+    return len;
 }
 
-entry *_entry_find_copy(entry *ent, darray *entries) {
-    static darray *pool = NULL;
-    if (ent == NULL) {
-        pool = entries;
+int nums_add(value *nums, size_t len, value num) {
+    int overflow = 0;
+    for (size_t i = 0; i < len; i++) {
+        overflow |= __builtin_add_overflow(nums[i], num, &nums[i]);
     }
 
-    size_t idx;
-    if (!darray_search(pool, ent->key, (comparator) entry_has_key, &idx)) {
+    return !overflow;
+}
+
+int nums_mul(value *nums, size_t len, value num) {
+    int overflow = 0;
+    for (size_t i = 0; i < len; i++) {
+        overflow |= __builtin_mul_overflow(nums[i], num, &nums[i]);
+    }
+
+    return !overflow;
+}
+
+void nums_clamp(value *nums, size_t len, value lo, value hi) {
+    for (size_t i = 0; i < len; i++) {
+        value num = nums[i] < lo ? lo : nums[i];
+        nums[i] = num > hi ? hi : num;
+    }
+}
+
+size_t nums_filter(value *nums, size_t len, int cmp, value num) {
+    /* Every integer is written, and the position only moves past kept ones. */
+    size_t kept = 0;
+    for (size_t i = 0; i < len; i++) {
+        value cur = nums[i];
+        nums[kept] = cur;
+        kept += ((cur > num) - (cur < num)) == cmp;
+    }
+
+    return kept;
+}
+
+void entry_store_nums(entry *ent, const value *nums, size_t len) {
+    if (ent->packed != NULL) {
+        del_encoded(ent->packed);
+        ent->packed = NULL;
+        if (len >= PACKLEN) {
+            ent->packed = encode_ints(nums, len,
+                    len * (sizeof(element) + sizeof(element *)));
+        }
+        for (size_t i = 0; ent->packed == NULL && i < len; i++) {
+            darray_append(ent->elements, new_int_ele(nums[i]));
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        element *ele = darray_get(ent->elements, i);
+        ele->value.num = nums[i];
+    }
+    darray_pop_range(ent->elements, len, darray_len(ent->elements));
+}
+
+value *entry_set(entry *ent, size_t *lenp) {
+    value *nums = entry_nums(ent);
+    if (nums == NULL) {
         return NULL;
     }
 
-    return darray_get(pool, idx);
+    size_t len = entry_count(ent);
+    if (!ent->sorted) {
+        qsort(nums, len, sizeof(value),
+                (int (*)(const void *, const void *)) value_cmp);
+    }
+    *lenp = nums_unique(nums, len);
+
+    return nums;
+}
+
+void entry_sketch_add(entry *ent, darray *elements) {
+    if (ent->sketch == NULL || sketch_is_stale(ent->sketch)) {
+        return;
+    }
+
+    for (size_t i = 0; i < darray_len(elements); i++) {
+        element *ele = darray_get(elements, i);
+        if (ele->type == INTEGER) {
+            sketch_add(ent->sketch, ele->value.num);
+        }
+    }
+}
+
+void entry_sketch_stale(entry *ent) {
+    if (ent->sketch != NULL) {
+        sketch_mark_stale(ent->sketch);
+    }
+}
+
+sketch *entry_sketch(entry *ent) {
+    if (ent->sketch == NULL || !sketch_is_stale(ent->sketch)) {
+        return ent->sketch;
+    }
+
+    sketch_clear(ent->sketch);
+    if (ent->packed != NULL) {
+        size_t len = entry_count(ent);
+        value *nums = entry_nums(ent);
+        for (size_t i = 0; nums != NULL && i < len; i++) {
+            sketch_add(ent->sketch, nums[i]);
+        }
+        free(nums);
+    }
+    entry_sketch_add(ent, ent->elements);
+
+    return ent->sketch;
+}
+
+void entry_print_flat(entry *ent) {
+    darray *stack = new_darray(NULL);
+    char *sep = "";
+
+    printf("[");
+    generation++;
+    entry_visit(ent, stack);
+    while (darray_len(stack) != 0) {
+        entry *top = darray_get(stack, darray_len(stack) - 1);
+        if (top->packed != NULL && top->cursor == 0) {
+            size_t len = encoded_len(top->packed);
+            value *nums = (value *) malloc(len * sizeof(value));
+            encoded_decode(top->packed, nums);
+            for (size_t i = 0; i < len; i++) {
+                printf("%s" VALUE_FMT, sep, nums[i]);
+                sep = " ";
+            }
+            free(nums);
+        }
+        element *ele = darray_get(top->elements, top->cursor++);
+        if (ele == NULL) {
+            /* Leaving the path lets a diamond visit the entry again. */
+            top->stamp = 0;
+            darray_pop(stack, darray_len(stack) - 1);
+        } else if (ele->type == INTEGER) {
+            printf("%s" VALUE_FMT, sep, ele->value.num);
+            sep = " ";
+        } else if (ele->value.entry->stamp != generation) {
+            entry_visit(ele->value.entry, stack);
+        }
+    }
+    printf("]\n");
+    del_darray(stack);
+}
+
+darray *entry_reach(entry *ent, int backward) {
+    darray *reached = new_darray(NULL);
+
+    generation++;
+    size_t i = 0;
+    for (entry *top = ent; top != NULL; top = darray_get(reached, i++)) {
+        darray *next = backward ? top->backward : top->forward;
+        for (size_t j = 0; j < darray_len(next); j++) {
+            entry *ent_ref = darray_get(next, j);
+            if (ent_ref->stamp != generation) {
+                ent_ref->stamp = generation;
+                darray_append(reached, ent_ref);
+            }
+        }
+    }
+
+    return reached;
+}
+
+darray *entry_path(entry *from, entry *to) {
+    darray *queue = new_darray(NULL);
+    darray *path = new_darray(NULL);
+
+    generation++;
+    from->stamp = generation;
+    from->cursor = SIZE_MAX;
+    darray_append(queue, from);
+    for (size_t i = 0; i < darray_len(queue) && to->stamp != generation; i++) {
+        entry *top = darray_get(queue, i);
+        for (size_t j = 0; j < darray_len(top->forward); j++) {
+            entry *ent_ref = darray_get(top->forward, j);
+            if (ent_ref->stamp != generation) {
+                ent_ref->stamp = generation;
+                ent_ref->cursor = i;
+                darray_append(queue, ent_ref);
+            }
+        }
+    }
+
+    if (to->stamp == generation) {
+        for (entry *cur = to; ; cur = darray_get(queue, cur->cursor)) {
+            darray_insert(path, 0, cur);
+            if (cur->cursor == SIZE_MAX) {
+                break;
+            }
+        }
+    }
+    del_darray(queue);
+
+    return path;
+}
+
+size_t entry_depth(entry *ent) {
+    darray *stack = new_darray(NULL);
+
+    generation++;
+    ent->stamp = generation;
+    ent->cursor = 0;
+    ent->depth = 0;
+    darray_append(stack, ent);
+    while (darray_len(stack) != 0) {
+        entry *top = darray_get(stack, darray_len(stack) - 1);
+        entry *next = darray_get(top->forward, top->cursor++);
+        entry *done = NULL;
+        if (next == NULL) {
+            top->cursor = SIZE_MAX;
+            darray_pop(stack, darray_len(stack) - 1);
+            if (darray_len(stack) != 0) {
+                done = top;
+                top = darray_get(stack, darray_len(stack) - 1);
+            }
+        } else if (next->stamp != generation) {
+            next->stamp = generation;
+            next->cursor = 0;
+            next->depth = 0;
+            darray_append(stack, next);
+        } else if (next->cursor == SIZE_MAX) {
+            done = next;
+        }
+        if (done != NULL && done->depth + 1 > top->depth) {
+            top->depth = done->depth + 1;
+        }
+    }
+    del_darray(stack);
+
+    return ent->depth;
+}
+
+darray *entries_topo(darray *entries) {
+    darray *order = new_darray(NULL);
+
+    for (size_t i = 0; i < darray_len(entries); i++) {
+        entry *ent = darray_get(entries, i);
+        ent->cursor = darray_len(ent->forward);
+        if (ent->cursor == 0) {
+            darray_append(order, ent);
+        }
+    }
+    for (size_t i = 0; i < darray_len(order); i++) {
+        entry *ent = darray_get(order, i);
+        for (size_t j = 0; j < darray_len(ent->backward); j++) {
+            entry *ent_ref = darray_get(ent->backward, j);
+            if (--ent_ref->cursor == 0) {
+                darray_append(order, ent_ref);
+            }
+        }
+    }
+
+    return order;
 }
 
-void entry_find_pool(darray *pool) {
-    _entry_find_copy(NULL, pool);
+entry *entry_empty_copy(entry *ent) {
+    entry *cpy = (entry *) malloc(sizeof(entry));
+    slow_allocs++;
+    strcpy(cpy->key, ent->key);
+    cpy->packed = NULL;
+    cpy->stamp = 0;
+    cpy->sorted = ent->sorted;
+    cpy->sketch = NULL;
+
+    return cpy;
 }
 
 entry *entry_find_copy(entry *ent) {
-    return _entry_find_copy(ent, NULL);
+    return ent->copy;
 }
 
 void del_entry(entry *ent) {
     del_darray(ent->elements);
     del_darray(ent->forward);
     del_darray(ent->backward);
+    del_encoded(ent->packed);
+    del_sketch(ent->sketch);
 
     free(ent);
 }
@@ -352,11 +988,9 @@ void print_entry_list(darray *entries) {
 
 int entries_can_purge_key(darray *entries, char *key) {
     entry *ent;
-    size_t idx;
-    if (!darray_search(entries, key, (comparator) entry_has_key, &idx)) {
+    if ((ent = entries_lookup(entries, key)) == NULL) {
         return 1;
     }
-    ent = darray_get(entries, idx);
     if (darray_len(ent->backward) != 0) {
         return 0;
     }
@@ -367,672 +1001,3806 @@ int entries_can_purge_key(darray *entries, char *key) {
 void entries_purge_key(darray *entries, char *key) {
     entry *ent;
     size_t idx;
-    if (!darray_search(entries, key, (comparator) entry_has_key, &idx)) {
+    if ((ent = entries_lookup(entries, key)) == NULL) {
         return;
     }
-    ent = darray_get(entries, idx);
     darray_search(entries, ent, compare_ptr, &idx);
+    keys_remove(entries, ent);
     entry_deref_all(ent);
     darray_pop(entries, idx);
 }
 
-darray *entries_clone(darray *entries) {
-    darray *clone = darray_clone(entries, (unary) entry_empty_copy);
+size_t clone_threads = 1;
 
-    entry_find_pool(clone);
+struct clone_range {
+    pthread_t thread;
+    int started;
+    darray *entries;
+    size_t start;
+    size_t end;
+};
 
-    for (size_t i = 0; i < darray_len(entries); i++) {
-        entry *ent_ori = darray_get(entries, i);
-        entry *ent_cpy = darray_get(clone, i);
+void entry_clone_body(entry *ent_ori) {
+    entry *ent_cpy = ent_ori->copy;
+    slow_touched += entry_count(ent_ori);
 
-        ent_cpy->elements = darray_clone(ent_ori->elements,
-                (unary) element_find_copy);
+    ent_cpy->elements = darray_clone(ent_ori->elements,
+            (unary) element_find_copy);
 
-        ent_cpy->forward = darray_clone(ent_ori->forward,
-                (unary) entry_find_copy);
-        ent_cpy->backward = darray_clone(ent_ori->backward,
-                (unary) entry_find_copy);
+    ent_cpy->forward = darray_clone(ent_ori->forward,
+            (unary) entry_find_copy);
+    ent_cpy->backward = darray_clone(ent_ori->backward,
+            (unary) entry_find_copy);
+    if (ent_ori->packed != NULL) {
+        ent_cpy->packed = encoded_clone(ent_ori->packed);
+    }
+    if (ent_ori->sketch != NULL) {
+        ent_cpy->sketch = sketch_clone(ent_ori->sketch);
     }
-    entry_find_pool(NULL);
-
-    return clone;
 }
 
-snapshot *new_snapshot(darray *entries) {
-    static size_t new_id = 1;
-    snapshot *snap = (snapshot *) malloc(sizeof(snapshot));
-
-    if (snap != NULL) {
-        snap->id = new_id++;
-        snap->entries = entries_clone(entries);
+void *clone_range_run(clone_range *range) {
+    for (size_t i = range->start; i < range->end; i++) {
+        entry_clone_body(darray_get(range->entries, i));
     }
+    slowlog_share();
 
-    return snap;
+    return NULL;
 }
 
-void snapshot_print(snapshot *snap) {
-    printf("%zu\n", snap->id);
-}
+darray *entries_clone(darray *entries) {
+    TRACE1(clone__start, darray_len(entries));
+    darray *clone = darray_clone(entries, (unary) entry_empty_copy);
 
-int snapshot_has_id(const snapshot *snap, const size_t *id) {
-    return snap->id != *id;
+    for (size_t i = 0; i < darray_len(entries); i++) {
+        entry *ent = darray_get(entries, i);
+        ent->copy = darray_get(clone, i);
+    }
+
+    size_t len = darray_len(entries);
+    if (clone_threads <= 1 || len < CLONEMIN) {
+        darray_foreach(entries, (consumer) entry_clone_body);
+        TRACE1(clone__done, len);
+        return clone;
+    }
+
+    /* Every worker only writes to the copies of the entries in its range. */
+    clone_range ranges[MAXTHREADS];
+    for (size_t i = 0; i < clone_threads; i++) {
+        ranges[i].entries = entries;
+        ranges[i].start = len * i / clone_threads;
+        ranges[i].end = len * (i + 1) / clone_threads;
+        ranges[i].started = 0;
+        if (i > 0 && pthread_create(&ranges[i].thread, NULL,
+                    (void *(*)(void *)) clone_range_run, &ranges[i]) == 0) {
+            ranges[i].started = 1;
+        } else {
+            clone_range_run(&ranges[i]);
+        }
+    }
+    for (size_t i = 0; i < clone_threads; i++) {
+        if (ranges[i].started) {
+            pthread_join(ranges[i].thread, NULL);
+        }
+    }
+    TRACE1(clone__done, darray_len(entries));
+
+    return clone;
+}
+
+/* Garbage collection */
+
+darray *garbage = NULL;
+size_t garbage_cost = 0;
+size_t garbage_limit = SIZE_MAX;
+size_t garbage_reclaimed = 0;
+
+size_t entry_cost(entry *ent) {
+    return 1 + darray_len(ent->elements)
+        + darray_len(ent->forward) + darray_len(ent->backward);
+}
+
+void gc_defer(darray *entries) {
+    if (garbage == NULL) {
+        garbage = new_darray((consumer) del_entry);
+    }
+
+    for (size_t i = 0; i < darray_len(entries); i++) {
+        garbage_cost += entry_cost(darray_get(entries, i));
+    }
+    darray_extend(garbage, entries);
+    darray_set_item_free(entries, NULL);
+    del_darray(entries);
+
+    if (garbage_cost > garbage_limit) {
+        gc_step(garbage_cost - garbage_limit);
+    }
+}
+
+void gc_step(size_t budget) {
+    size_t done = 0;
+    while (done < budget && garbage != NULL && darray_len(garbage) != 0) {
+        size_t last = darray_len(garbage) - 1;
+        size_t cost = entry_cost(darray_get(garbage, last));
+        darray_pop(garbage, last);
+        garbage_cost -= cost;
+        garbage_reclaimed++;
+        done += cost;
+    }
+}
+
+size_t next_snapshot_id = 1;
+
+snapshot *new_snapshot(darray *entries) {
+    snapshot *snap = (snapshot *) malloc(sizeof(snapshot));
+
+    if (snap != NULL) {
+        snap->id = next_snapshot_id++;
+        snap->taken = time(NULL);
+        snap->entries = entries_clone(entries);
+        snap->keys = NULL;
+    }
+
+    return snap;
+}
+
+void snapshot_print(snapshot *snap) {
+    printf("%zu\n", snap->id);
+}
+
+int snapshot_has_id(const snapshot *snap, const size_t *id) {
+    return snap->id != *id;
+}
+
+void del_snapshot(snapshot *snap) {
+    keys_forget(snap);
+    gc_defer(snap->entries);
+    free(snap);
+}
+
+/* Retention */
+
+size_t retain_last = SIZE_MAX;
+size_t retain_every = 0;
+size_t retain_cost = SIZE_MAX;
+
+size_t snapshot_cost(snapshot *snap) {
+    size_t cost = 0;
+    for (size_t i = 0; i < darray_len(snap->entries); i++) {
+        cost += entry_cost(darray_get(snap->entries, i));
+    }
+
+    return cost;
+}
+
+void snapshot_retire(darray *snapshots, size_t idx) {
+    char line[BUFLEN];
+    snapshot *snap = darray_get(snapshots, idx);
+    sprintf(line, "DROP %zu", snap->id);
+    replica_broadcast(line);
+    darray_pop(snapshots, idx);
+}
+
+void snapshots_retain(darray *snapshots) {
+    /* Followers drop snapshots when the leader tells them to. */
+    if (replica_get_role() == FOLLOWER) {
+        return;
+    }
+
+    /* Snapshots are kept by either of the last and every limits. */
+    time_t period = -1;
+    for (size_t i = 0; i < darray_len(snapshots); i++) {
+        snapshot *snap = darray_get(snapshots, i);
+        int keep = retain_last != SIZE_MAX
+            ? i < retain_last : retain_every == 0;
+        if (retain_every > 0 && snap->taken / (time_t) retain_every != period) {
+            period = snap->taken / (time_t) retain_every;
+            keep = 1;
+        }
+        if (!keep) {
+            snapshot_retire(snapshots, i--);
+        }
+    }
+
+    size_t cost = 0;
+    for (size_t i = 0; i < darray_len(snapshots); i++) {
+        cost += snapshot_cost(darray_get(snapshots, i));
+        if (i > 0 && cost > retain_cost) {
+            while (darray_len(snapshots) > i) {
+                snapshot_retire(snapshots, darray_len(snapshots) - 1);
+            }
+        }
+    }
+}
+
+/* Persistence */
+
+struct saving {
+    pid_t pid;
+    int pipe;
+    int failed;
+    char path[BUFLEN];
+    size_t bytes;
+    double seconds;
+};
+
+saving last_save = { 0, -1, 0, "", 0, 0 };
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void dump_token(FILE *fp, char *line, size_t *len, const char *key,
+        const char *token) {
+    size_t toklen = strlen(token);
+    if (*len + 1 + toklen + 1 >= BUFLEN) {
+        fprintf(fp, "%s\n", line);
+        *len = sprintf(line, "APPEND %s", key);
+    }
+    line[(*len)++] = ' ';
+    strcpy(line + *len, token);
+    *len += toklen;
+}
+
+void entry_dump(entry *ent, FILE *fp, int links) {
+    char line[BUFLEN];
+    char token[VALUELEN];
+    size_t first = 0;
+    element *ele;
+    while ((ele = darray_get(ent->elements, first)) != NULL
+            && ele->type == INTEGER) {
+        first++;
+    }
+    if (links && first == darray_len(ent->elements)) {
+        return;
+    }
+    size_t len = sprintf(line, links ? "APPEND %s" : "SET %s", ent->key);
+
+    if (!links && ent->packed != NULL) {
+        size_t count = encoded_len(ent->packed);
+        value *nums = (value *) malloc(count * sizeof(value));
+        encoded_decode(ent->packed, nums);
+        for (size_t i = 0; i < count; i++) {
+            sprintf(token, VALUE_FMT, nums[i]);
+            dump_token(fp, line, &len, ent->key, token);
+        }
+        free(nums);
+    }
+    size_t end = links ? darray_len(ent->elements) : first;
+    for (size_t i = links ? first : 0; i < end; i++) {
+        ele = darray_get(ent->elements, i);
+        if (ele->type == INTEGER) {
+            sprintf(token, VALUE_FMT, ele->value.num);
+            dump_token(fp, line, &len, ent->key, token);
+        } else {
+            dump_token(fp, line, &len, ent->key, ele->value.entry->key);
+        }
+    }
+    fprintf(fp, "%s\n", line);
+}
+
+int entries_dump(darray *entries, FILE *fp) {
+    /* Every key exists before any reference to it, so cycles replay. */
+    for (int links = 0; links <= 1; links++) {
+        for (size_t i = darray_len(entries); i > 0; i--) {
+            entry_dump(darray_get(entries, i - 1), fp, links);
+        }
+    }
+
+    return !ferror(fp);
+}
+
+int entries_save(darray *entries, const char *path) {
+    if (last_save.pid != 0) {
+        return 0;
+    }
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return 0;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+
+    if (pid == 0) {
+        /* The child sees a frozen copy-on-write image of the entries. */
+        double start = now_seconds();
+        char tmp[BUFLEN + 4];
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+        FILE *fp = fopen(tmp, "w");
+        int ok = fp != NULL && entries_dump(entries, fp);
+        long bytes = fp != NULL ? ftell(fp) : 0;
+        if (fp != NULL && fclose(fp) != 0) {
+            ok = 0;
+        }
+        if (ok && rename(tmp, path) != 0) {
+            ok = 0;
+        }
+
+        char report[64];
+        int len = sprintf(report, "%d %ld %f", ok, bytes,
+                now_seconds() - start);
+        if (write(fds[1], report, len) != len) {
+            ok = 0;
+        }
+        _exit(ok ? 0 : 1);
+    }
+
+    close(fds[1]);
+    last_save.pid = pid;
+    last_save.pipe = fds[0];
+    snprintf(last_save.path, BUFLEN, "%s", path);
+
+    return 1;
+}
+
+int save_poll(int wait) {
+    if (last_save.pid == 0) {
+        return 0;
+    }
+
+    int status;
+    if (waitpid(last_save.pid, &status, wait ? 0 : WNOHANG) == 0) {
+        return 1;
+    }
+
+    char report[64] = "";
+    int ok = 0;
+    long bytes = 0;
+    ssize_t len = read(last_save.pipe, report, sizeof(report) - 1);
+    if (len > 0) {
+        report[len] = '\0';
+        sscanf(report, "%d %ld %lf", &ok, &bytes, &last_save.seconds);
+    }
+    close(last_save.pipe);
+
+    last_save.pid = 0;
+    last_save.pipe = -1;
+    last_save.failed = !(ok && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    last_save.bytes = bytes;
+
+    return 0;
+}
+
+struct load_line {
+    char *key;
+    int append;
+    size_t number;
+    darray *elements;
+    darray *names;
+    load_key *target;
+    const char *error;
+};
+
+struct load_chunk {
+    pthread_t thread;
+    int started;
+    char *start;
+    char *end;
+    size_t lines;
+    darray *parsed;
+};
+
+struct load_key {
+    char *key;
+    entry *ent;
+    size_t set_line;
+    size_t base;
+};
+
+void del_load_line(load_line *line) {
+    del_darray(line->elements);
+    del_darray(line->names);
+    free(line);
+}
+
+load_line *load_parse_line(char *text) {
+    char *comm;
+    do {
+        comm = strsep(&text, WHITESPACE);
+    } while (comm != NULL && *comm == '\0');
+    if (comm == NULL) {
+        return NULL;
+    }
+
+    load_line *line = (load_line *) malloc(sizeof(load_line));
+    line->key = NULL;
+    line->append = strcasecmp(comm, "append") == 0;
+    line->elements = new_darray(free);
+    line->names = new_darray(NULL);
+    line->target = NULL;
+    line->error = NULL;
+    if (!line->append && strcasecmp(comm, "set") != 0) {
+        line->error = "invalid command";
+        return line;
+    }
+
+    do {
+        line->key = strsep(&text, WHITESPACE);
+    } while (line->key != NULL && *line->key == '\0');
+    if (line->key == NULL) {
+        line->error = "missing key";
+        return line;
+    }
+    if (!key_is_valid(line->key)) {
+        line->error = "invalid key";
+        return line;
+    }
+
+    char *token;
+    while ((token = strsep(&text, WHITESPACE)) != NULL) {
+        value num;
+        if (*token == '\0') {
+            continue;
+        } else if (isdigit(*token) || *token == '-') {
+            if (!parse_decimal(token, strlen(token), &num)) {
+                line->error = "invalid integer";
+                return line;
+            }
+            darray_append(line->elements, new_int_ele(num));
+        } else if (strcmp(token, line->key) == 0) {
+            line->error = "not permitted";
+            return line;
+        } else {
+            darray_append(line->elements, new_ent_ele(NULL));
+            darray_append(line->names, token);
+        }
+    }
+
+    return line;
+}
+
+void *load_chunk_run(load_chunk *chunk) {
+    char *text = chunk->start;
+    while (text < chunk->end) {
+        char *eol = memchr(text, '\n', chunk->end - text);
+        if (eol == NULL) {
+            eol = chunk->end;
+        }
+        *eol = '\0';
+        chunk->lines++;
+
+        load_line *line = load_parse_line(text);
+        if (line != NULL) {
+            line->number = chunk->lines;
+            darray_append(chunk->parsed, line);
+            if (line->error != NULL) {
+                break;
+            }
+        }
+        text = eol + 1;
+    }
+    slowlog_share();
+
+    return NULL;
+}
+
+size_t load_threads = 1;
+
+darray *load_parse(char *text, size_t len) {
+    size_t workers = len >= LOADMIN ? load_threads : 1;
+    load_chunk chunks[MAXTHREADS];
+    char *start = text;
+    for (size_t i = 0; i < workers; i++) {
+        char *end = text + len * (i + 1) / workers;
+        if (i + 1 < workers && end > start) {
+            char *eol = memchr(end, '\n', text + len - end);
+            end = eol == NULL ? text + len : eol + 1;
+        }
+        if (end < start) {
+            end = start;
+        }
+        chunks[i].start = start;
+        chunks[i].end = end;
+        chunks[i].started = 0;
+        chunks[i].lines = 0;
+        chunks[i].parsed = new_darray((consumer) del_load_line);
+        start = end;
+    }
+
+    for (size_t i = 0; i < workers; i++) {
+        if (i > 0 && pthread_create(&chunks[i].thread, NULL,
+                    (void *(*)(void *)) load_chunk_run, &chunks[i]) == 0) {
+            chunks[i].started = 1;
+        } else {
+            load_chunk_run(&chunks[i]);
+        }
+    }
+
+    /* Line numbers are counted from the start of each chunk until joined. */
+    darray *lines = new_darray((consumer) del_load_line);
+    size_t offset = 0;
+    for (size_t i = 0; i < workers; i++) {
+        if (chunks[i].started) {
+            pthread_join(chunks[i].thread, NULL);
+        }
+        for (size_t j = 0; j < darray_len(chunks[i].parsed); j++) {
+            load_line *line = darray_get(chunks[i].parsed, j);
+            line->number += offset;
+        }
+        offset += chunks[i].lines;
+        darray_extend(lines, chunks[i].parsed);
+        darray_set_item_free(chunks[i].parsed, NULL);
+        del_darray(chunks[i].parsed);
+    }
+
+    return lines;
+}
+
+int load_line_cmp(const load_line *line1, const load_line *line2) {
+    int cmp = strcmp(line1->key, line2->key);
+    if (cmp != 0) {
+        return cmp;
+    }
+
+    return (line1->number > line2->number) - (line1->number < line2->number);
+}
+
+int load_key_newer(const load_key *key1, const load_key *key2) {
+    return (key1->set_line < key2->set_line)
+        - (key1->set_line > key2->set_line);
+}
+
+load_key *load_find(darray *keys, const char *key) {
+    size_t lo = 0, hi = darray_len(keys);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        load_key *found = darray_get(keys, mid);
+        int cmp = strcmp(found->key, key);
+        if (cmp == 0) {
+            return found;
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return NULL;
+}
+
+int load_check(darray *lines, darray *keys, darray *entries,
+        char *error, size_t size) {
+    for (size_t i = 0; i < darray_len(lines); i++) {
+        load_line *line = darray_get(lines, i);
+        const char *message = line->error;
+        if (message == NULL && line->append
+                && line->target->set_line > line->number
+                && entries_lookup(entries, line->key) == NULL) {
+            message = "no such key";
+        }
+        for (size_t j = 0; message == NULL && j < darray_len(line->names);
+                j++) {
+            char *name = darray_get(line->names, j);
+            load_key *found = load_find(keys, name);
+            if ((found == NULL || found->set_line == SIZE_MAX)
+                    && entries_lookup(entries, name) == NULL) {
+                message = "no such key";
+            }
+        }
+        if (message != NULL) {
+            snprintf(error, size, "%s on line %zu", message, line->number);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void load_apply(darray *lines, darray *keys, darray *entries) {
+    darray *created = new_darray(NULL);
+    for (size_t i = 0; i < darray_len(keys); i++) {
+        load_key *key = darray_get(keys, i);
+        key->ent = entries_lookup(entries, key->key);
+        if (key->ent == NULL) {
+            key->ent = new_entry(key->key);
+            darray_append(created, key);
+        } else if (key->set_line != SIZE_MAX) {
+            index_entry(key->ent, -1);
+            entry_deref_all(key->ent);
+            entry_clear(key->ent);
+        } else {
+            entry_unpack(key->ent);
+            key->base = darray_len(key->ent->elements);
+        }
+    }
+
+    for (size_t i = 0; i < darray_len(lines); i++) {
+        load_line *line = darray_get(lines, i);
+        entry *ent = line->target->ent;
+        if (!line->append) {
+            darray_clear(ent->elements);
+        }
+        size_t name = 0;
+        for (size_t j = 0; j < darray_len(line->elements); j++) {
+            element *ele = darray_get(line->elements, j);
+            if (ele->type == ENTRY) {
+                char *key = darray_get(line->names, name++);
+                load_key *found = load_find(keys, key);
+                ele->value.entry = found != NULL
+                    ? found->ent : entries_lookup(entries, key);
+            }
+        }
+        darray_extend(ent->elements, line->elements);
+        darray_set_item_free(line->elements, NULL);
+        ent->sorted = 0;
+    }
+
+    /* References are linked once every entry holds its final elements. */
+    darray *added = new_darray(NULL);
+    for (size_t i = 0; i < darray_len(keys); i++) {
+        load_key *key = darray_get(keys, i);
+        darray_clear(added);
+        for (size_t j = key->base; j < darray_len(key->ent->elements); j++) {
+            darray_append(added, darray_get(key->ent->elements, j));
+        }
+        entry_ref_all(key->ent, added);
+        index_elements(key->ent, added, 1);
+        entry_sketch_add(key->ent, added);
+    }
+    del_darray(added);
+
+    /* New entries go in front as if each was set in turn. */
+    darray_sort(created, (comparator) load_key_newer);
+    darray *fresh = new_darray(NULL);
+    for (size_t i = 0; i < darray_len(created); i++) {
+        load_key *key = darray_get(created, i);
+        darray_append(fresh, key->ent);
+    }
+    darray_extend_at(entries, 0, fresh);
+    del_darray(fresh);
+    del_darray(created);
+    keys_rebuild(entries);
+}
+
+int entries_load(darray *entries, const char *path, darray *changed,
+        char *error, size_t size) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        snprintf(error, size, "can not open %s", path);
+        return 0;
+    }
+
+    size_t len = st.st_size;
+    char *text = (char *) malloc(len + 1);
+    size_t got = 0;
+    ssize_t n;
+    while (text != NULL && got < len
+            && (n = read(fd, text + got, len - got)) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            break;
+        }
+        got += n;
+    }
+    close(fd);
+    if (text == NULL || got < len) {
+        free(text);
+        snprintf(error, size, "can not read %s", path);
+        return 0;
+    }
+    text[len] = '\0';
+
+    darray *lines = load_parse(text, len);
+
+    /* Lines of the same key are grouped to give one target entry each. */
+    darray *keys = new_darray(free);
+    darray *sorted = new_darray(NULL);
+    darray_extend(sorted, lines);
+    int ok = 1;
+    for (size_t i = 0; i < darray_len(lines); i++) {
+        load_line *line = darray_get(lines, i);
+        if (line->error != NULL) {
+            snprintf(error, size, "%s on line %zu", line->error, line->number);
+            ok = 0;
+            break;
+        }
+    }
+    if (ok) {
+        darray_sort(sorted, (comparator) load_line_cmp);
+        load_key *key = NULL;
+        for (size_t i = 0; i < darray_len(sorted); i++) {
+            load_line *line = darray_get(sorted, i);
+            if (key == NULL || strcmp(key->key, line->key) != 0) {
+                key = (load_key *) malloc(sizeof(load_key));
+                key->key = line->key;
+                key->ent = NULL;
+                key->set_line = SIZE_MAX;
+                key->base = 0;
+                darray_append(keys, key);
+            }
+            if (!line->append && key->set_line == SIZE_MAX) {
+                key->set_line = line->number;
+            }
+            line->target = key;
+        }
+        ok = load_check(lines, keys, entries, error, size);
+    }
+    if (ok) {
+        load_apply(lines, keys, entries);
+    }
+    for (size_t i = 0; ok && changed != NULL && i < darray_len(entries); i++) {
+        entry *ent = darray_get(entries, i);
+        if (load_find(keys, ent->key) != NULL) {
+            darray_append(changed, ent);
+        }
+    }
+
+    del_darray(sorted);
+    del_darray(keys);
+    del_darray(lines);
+    free(text);
+
+    return ok;
+}
+
+/* Publishing */
+
+darray *published = NULL;
+
+size_t sorted_key_index(darray *sorted, const char *key) {
+    size_t lo = 0, hi = darray_len(sorted);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        entry *ent = darray_get(sorted, mid);
+        if (strcmp(ent->key, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+int snapshot_publish(snapshot *snap, const char *name) {
+    darray *sorted = entries_keys_range(snap->entries, NULL, NULL, NULL);
+
+    size_t nrefs = 0, nvalues = 0;
+    for (size_t i = 0; i < darray_len(sorted); i++) {
+        entry *ent = darray_get(sorted, i);
+        size_t nforward = darray_len(ent->forward);
+        nrefs += nforward;
+        nvalues += entry_count(ent) - nforward;
+    }
+
+    image_header *head = image_create(name,
+            image_size(darray_len(sorted), nrefs, nvalues));
+    if (head == NULL) {
+        del_darray(sorted);
+        return 0;
+    }
+    head->snapshot = snap->id;
+    head->taken = snap->taken;
+    head->nkeys = darray_len(sorted);
+    head->nrefs = nrefs;
+    head->nvalues = nvalues;
+
+    image_key *keys = image_keys(head);
+    image_ref *refs = image_refs(head);
+    value *values = image_values(head);
+    size_t ref = 0, num = 0;
+    for (size_t i = 0; i < darray_len(sorted); i++) {
+        entry *ent = darray_get(sorted, i);
+        image_key *key = &keys[i];
+        strncpy(key->key, ent->key, IMAGE_KEYLEN);
+        key->values = num;
+        key->refs = ref;
+
+        /* Packed entries are decoded straight into the image. */
+        if (ent->packed != NULL) {
+            encoded_decode(ent->packed, values + num);
+            num += encoded_len(ent->packed);
+        }
+        for (size_t j = 0; j < darray_len(ent->elements); j++) {
+            element *ele = darray_get(ent->elements, j);
+            if (ele->type == INTEGER) {
+                values[num++] = ele->value.num;
+            } else {
+                refs[ref].pos = j;
+                refs[ref++].key = sorted_key_index(sorted,
+                        ele->value.entry->key);
+            }
+        }
+        key->nvalues = num - key->values;
+        key->nrefs = ref - key->refs;
+    }
+    image_seal(head);
+    del_darray(sorted);
+
+    return 1;
+}
+
+void published_clear() {
+    for (size_t i = 0; i < darray_len(published); i++) {
+        shm_unlink(darray_get(published, i));
+    }
+    del_darray(published);
+    published = NULL;
+}
+
+/* Value index */
+
+struct usage {
+    entry *ent;
+    size_t bytes;
+};
+
+struct posting {
+    value value;
+    entry *ent;
+    size_t count;
+};
+
+darray *value_index = NULL;
+
+int posting_cmp(const posting *post, value value, const entry *ent) {
+    if (post->value < value) { return -1; }
+    if (post->value > value) { return 1; }
+    return compare_ptr(post->ent, ent);
+}
+
+size_t index_lower_bound(value value, const entry *ent) {
+    size_t lo = 0, hi = darray_len(value_index);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (posting_cmp(darray_get(value_index, mid), value, ent) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+void index_adjust(entry *ent, value value, int sign) {
+    if (value_index == NULL) {
+        return;
+    }
+
+    size_t idx = index_lower_bound(value, ent);
+    posting *post = darray_get(value_index, idx);
+    if (post != NULL && posting_cmp(post, value, ent) == 0) {
+        if (sign > 0) {
+            post->count++;
+        } else if (--post->count == 0) {
+            darray_pop(value_index, idx);
+        }
+    } else if (sign > 0) {
+        post = (posting *) malloc(sizeof(posting));
+        post->value = value;
+        post->ent = ent;
+        post->count = 1;
+        darray_insert(value_index, idx, post);
+    }
+}
+
+void index_elements(entry *ent, darray *elements, int sign) {
+    if (value_index == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < darray_len(elements); i++) {
+        element *ele = darray_get(elements, i);
+        if (ele->type == INTEGER) {
+            index_adjust(ent, ele->value.num, sign);
+        }
+    }
+}
+
+void index_entry(entry *ent, int sign) {
+    if (value_index == NULL) {
+        return;
+    }
+
+    if (ent->packed != NULL) {
+        size_t len = encoded_len(ent->packed);
+        value *nums = (value *) malloc(len * sizeof(value));
+        encoded_decode(ent->packed, nums);
+        for (size_t i = 0; i < len; i++) {
+            index_adjust(ent, nums[i], sign);
+        }
+        free(nums);
+    } else {
+        index_elements(ent, ent->elements, sign);
+    }
+}
+
+void index_rebuild(darray *entries) {
+    if (value_index == NULL) {
+        return;
+    }
+
+    darray_clear(value_index);
+    for (size_t i = 0; i < darray_len(entries); i++) {
+        index_entry(darray_get(entries, i), 1);
+    }
+}
+
+int entry_has_value(entry *ent, value lo, value hi) {
+    if (ent->packed != NULL) {
+        if (encoded_max(ent->packed) < lo || encoded_min(ent->packed) > hi) {
+            return 0;
+        }
+        size_t len = encoded_len(ent->packed);
+        value *nums = (value *) malloc(len * sizeof(value));
+        int found = 0;
+        encoded_decode(ent->packed, nums);
+        for (size_t i = 0; i < len && !found; i++) {
+            found = nums[i] >= lo && nums[i] <= hi;
+        }
+        free(nums);
+        return found;
+    }
+
+    for (size_t i = 0; i < darray_len(ent->elements); i++) {
+        element *ele = darray_get(ent->elements, i);
+        if (ele->type == INTEGER && ele->value.num >= lo
+                && ele->value.num <= hi) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+darray *entries_find(darray *entries, value lo, value hi) {
+    darray *found = new_darray(NULL);
+
+    if (value_index != NULL) {
+        for (size_t i = index_lower_bound(lo, NULL);
+                i < darray_len(value_index); i++) {
+            posting *post = darray_get(value_index, i);
+            if (post->value > hi) {
+                break;
+            }
+            darray_append(found, post->ent);
+        }
+    } else {
+        for (size_t i = 0; i < darray_len(entries); i++) {
+            entry *ent = darray_get(entries, i);
+            if (entry_has_value(ent, lo, hi)) {
+                darray_append(found, ent);
+            }
+        }
+    }
+
+    darray_sort(found, (comparator) entry_key_cmp);
+    darray_unique(found, (comparator) entry_key_cmp);
+
+    return found;
+}
+
+/* Key index */
+
+darray *key_index = NULL;
+darray *key_index_entries = NULL;
+
+darray *snapshot_keys = NULL;
+darray *snapshot_keys_entries = NULL;
+
+size_t keys_lower_bound(darray *sorted, const char *key) {
+    size_t lo = 0, hi = darray_len(sorted);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        entry *ent = darray_get(sorted, mid);
+        if (strcmp(ent->key, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+void keys_add(darray *entries, entry *ent) {
+    if (entries != key_index_entries) {
+        return;
+    }
+
+    darray_insert(key_index, keys_lower_bound(key_index, ent->key), ent);
+}
+
+void keys_remove(darray *entries, entry *ent) {
+    if (entries != key_index_entries) {
+        return;
+    }
+
+    size_t idx = keys_lower_bound(key_index, ent->key);
+    while (darray_get(key_index, idx) != ent) {
+        idx++;
+    }
+    darray_pop(key_index, idx);
+}
+
+void keys_rebuild(darray *entries) {
+    if (key_index == NULL) {
+        key_index = new_darray(NULL);
+    }
+
+    darray_clear(key_index);
+    darray_extend(key_index, entries);
+    darray_sort(key_index, (comparator) entry_key_cmp);
+    key_index_entries = entries;
+}
+
+void keys_select(snapshot *snap) {
+    if (snap->keys == NULL) {
+        snap->keys = new_darray(NULL);
+        darray_extend(snap->keys, snap->entries);
+        darray_sort(snap->keys, (comparator) entry_key_cmp);
+    }
+
+    snapshot_keys = snap->keys;
+    snapshot_keys_entries = snap->entries;
+}
+
+void keys_forget(snapshot *snap) {
+    if (snap->keys == snapshot_keys) {
+        snapshot_keys = NULL;
+        snapshot_keys_entries = NULL;
+    }
+
+    del_darray(snap->keys);
+    snap->keys = NULL;
+}
+
+darray *keys_sorted(darray *entries) {
+    if (entries == key_index_entries) {
+        return key_index;
+    }
+    if (entries == snapshot_keys_entries) {
+        return snapshot_keys;
+    }
+
+    return NULL;
+}
+
+entry *entries_lookup(darray *entries, const char *key) {
+    if (key == NULL) {
+        return NULL;
+    }
+
+    darray *sorted = keys_sorted(entries);
+    if (sorted != NULL) {
+        entry *ent = darray_get(sorted, keys_lower_bound(sorted, key));
+        return ent != NULL && strcmp(ent->key, key) == 0 ? ent : NULL;
+    }
+
+    size_t idx;
+    if (!darray_search(entries, key, (comparator) entry_has_key, &idx)) {
+        return NULL;
+    }
+
+    return darray_get(entries, idx);
+}
+
+darray *entries_keys_range(darray *entries, const char *from, const char *to,
+        const char *prefix) {
+    darray *index = keys_sorted(entries);
+    darray *sorted = index;
+    if (sorted == NULL) {
+        sorted = new_darray(NULL);
+        darray_extend(sorted, entries);
+        darray_sort(sorted, (comparator) entry_key_cmp);
+    }
+
+    darray *found = new_darray(NULL);
+    size_t start = 0;
+    if (prefix != NULL || from != NULL) {
+        const char *low = prefix != NULL ? prefix : from;
+        size_t lo = 0, hi = darray_len(sorted);
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            entry *ent = darray_get(sorted, mid);
+            if (strcmp(ent->key, low) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        start = lo;
+    }
+    for (size_t i = start; i < darray_len(sorted); i++) {
+        entry *ent = darray_get(sorted, i);
+        if (prefix != NULL && strncmp(ent->key, prefix, strlen(prefix)) != 0) {
+            break;
+        }
+        if (to != NULL && strcmp(ent->key, to) > 0) {
+            break;
+        }
+        darray_append(found, ent);
+    }
+
+    if (sorted != index) {
+        del_darray(sorted);
+    }
+
+    return found;
+}
+
+/* Memory accounting */
+
+size_t darray_bytes(darray *arr) {
+    return DARRAYBYTES + darray_len(arr) * sizeof(void *);
+}
+
+size_t entry_memory(entry *ent) {
+    size_t bytes = sizeof(entry)
+        + darray_bytes(ent->elements)
+        + darray_len(ent->elements) * sizeof(element)
+        + darray_bytes(ent->forward)
+        + darray_bytes(ent->backward);
+    if (ent->packed != NULL) {
+        bytes += encoded_size(ent->packed);
+    }
+    if (ent->sketch != NULL) {
+        bytes += sketch_size(ent->sketch);
+    }
+
+    return bytes;
+}
+
+size_t entries_memory(darray *entries) {
+    size_t bytes = darray_bytes(entries);
+    for (size_t i = 0; i < darray_len(entries); i++) {
+        bytes += entry_memory(darray_get(entries, i));
+    }
+
+    return bytes;
+}
+
+size_t snapshot_memory(snapshot *snap) {
+    size_t bytes = sizeof(snapshot) + entries_memory(snap->entries);
+    if (snap->keys != NULL) {
+        bytes += darray_bytes(snap->keys);
+    }
+
+    return bytes;
+}
+
+size_t index_memory() {
+    if (value_index == NULL) {
+        return 0;
+    }
+
+    return darray_bytes(value_index)
+        + darray_len(value_index) * sizeof(posting);
+}
+
+int usage_cmp(const usage *use1, const usage *use2) {
+    if (use1->bytes != use2->bytes) {
+        return use1->bytes < use2->bytes ? 1 : -1;
+    }
+
+    return strcmp(use1->ent->key, use2->ent->key);
+}
+
+/* Slow log */
+
+struct slow_command {
+    size_t id;
+    char line[SLOWLINELEN];
+    long long micros;
+    size_t touched;
+    size_t allocs;
+};
+
+slow_command slowlog[SLOWLEN];
+size_t slowlog_count = 0;
+size_t slowlog_len = 0;
+long long slowlog_threshold = SLOWMICROS;
+
+/* Work handed over by worker threads, not yet taken by a command. */
+atomic_size_t slow_shared_touched = 0;
+atomic_size_t slow_shared_allocs = 0;
+
+void slowlog_share() {
+    atomic_fetch_add(&slow_shared_touched, slow_touched);
+    atomic_fetch_add(&slow_shared_allocs, slow_allocs);
+    slow_touched = 0;
+    slow_allocs = 0;
+}
+
+void slowlog_take(size_t *touchedp, size_t *allocsp) {
+    slowlog_share();
+    *touchedp = atomic_exchange(&slow_shared_touched, 0);
+    *allocsp = atomic_exchange(&slow_shared_allocs, 0);
+}
+
+void slowlog_add(const char *line, long long micros,
+        size_t touched, size_t allocs) {
+    /* The newest command overwrites the oldest once the log is full. */
+    slow_command *slow = &slowlog[slowlog_count % SLOWLEN];
+    slow->id = ++slowlog_count;
+    strncpy(slow->line, line, SLOWLINELEN - 1);
+    slow->line[SLOWLINELEN - 1] = '\0';
+    slow->micros = micros;
+    slow->touched = touched;
+    slow->allocs = allocs;
+    if (slowlog_len < SLOWLEN) {
+        slowlog_len++;
+    }
+}
+
+void slowlog_print() {
+    if (slowlog_len == 0) {
+        printf("no slow commands\n");
+        return;
+    }
+
+    for (size_t i = 0; i < slowlog_len; i++) {
+        slow_command *slow = &slowlog[(slowlog_count - 1 - i) % SLOWLEN];
+        printf("%zu %s: %lld us, %zu elements touched, %zu allocations\n",
+                slow->id, slow->line, slow->micros, slow->touched,
+                slow->allocs);
+    }
+}
+
+/* Helper parsers */
+
+/* Characters ending a token of an element list, including the terminator. */
+const char TOKEN_END[256] = {
+    ['\0'] = 1, [' '] = 1, ['\t'] = 1, ['\r'] = 1, ['\n'] = 1, ['\v'] = 1,
+    ['\f'] = 1
+};
+
+int parse_decimal(const char *str, size_t len, value *resp) {
+    int negative = len > 0 && str[0] == '-';
+    size_t i = negative;
+    if (i == len) {
+        return 0;
+    }
+
+    uvalue limit = negative ? (uvalue) VALUE_MAX + 1 : (uvalue) VALUE_MAX;
+    uvalue num = 0;
+    for (; i < len; i++) {
+        unsigned digit = (unsigned char) str[i] - '0';
+        if (digit > 9 || num > (limit - digit) / 10) {
+            return 0;
+        }
+        num = num * 10 + digit;
+    }
+    *resp = negative ? -(value) (num - 1) - 1 : (value) num;
+    return 1;
+}
+
+int parse_int(char *str, value *resp) {
+    char *end;
+    errno = 0;
+    long long num = strtoll(str, &end, 10);
+    if (end == str || *end != '\0' || errno == ERANGE
+            || num < VALUE_MIN || num > VALUE_MAX) {
+        return 0;
+    }
+    *resp = num;
+    return 1;
+}
+
+int parse_index(char *str, size_t max, size_t *resp) {
+    if (str == NULL) {
+        return 0;
+    }
+
+    char *end;
+    unsigned long num = strtoul(str, &end, 10);
+    if (end == str || *end != '\0' || num == 0 || num > max) {
+        return 0;
+    }
+    *resp = num;
+    return 1;
+}
+
+darray *parse_elements(char **strp, darray *entries, entry *self) {
+    darray *elements = new_darray(free);
+
+    /* Splits the same way as strsep, finding each token in a single scan. */
+    char *next = *strp;
+    *strp = NULL;
+    while (next != NULL) {
+        char *token = next;
+        char *end = token;
+        while (!TOKEN_END[(unsigned char) *end]) {
+            end++;
+        }
+        if (*end == '\0') {
+            next = NULL;
+        } else {
+            *end = '\0';
+            next = end + 1;
+        }
+
+        value num;
+        element *ele;
+        if (isdigit(*token) || *token == '-') {
+            if (parse_decimal(token, end - token, &num)) {
+                ele = new_int_ele(num);
+            } else {
+                command_error("invalid integer");
+                del_darray(elements);
+                return NULL;
+            }
+        }
+        else {
+            if (strcmp(token, self->key) == 0) {
+                command_error("not permitted");
+                del_darray(elements);
+                return NULL;
+            }
+            entry *ent = entries_lookup(entries, token);
+            if (ent == NULL) {
+                command_error("no such key");
+                del_darray(elements);
+                return NULL;
+            }
+            ele = new_ent_ele(ent);
+        }
+        darray_append(elements, ele);
+    }
+
+    darray_set_item_free(elements, NULL);
+
+    return elements;
+}
+
+int key_is_valid(const char *key) {
+    return strcasecmp(key, "at") != 0;
+}
+
+int parse_at(char *args, darray *snapshots, darray **entriesp) {
+    if (args == NULL) {
+        return 1;
+    }
+
+    size_t end = strlen(args);
+    while (end > 0 && isspace(args[end - 1])) {
+        end--;
+    }
+    size_t num = end;
+    while (num > 0 && isdigit(args[num - 1])) {
+        num--;
+    }
+    size_t at = num;
+    while (at > 0 && isspace(args[at - 1])) {
+        at--;
+    }
+    if (num == end || at == num || at < 2
+            || (at > 2 && !isspace(args[at - 3]))
+            || strncasecmp(args + at - 2, "at", 2) != 0) {
+        return 1;
+    }
+
+    size_t id, snap_idx = 0;
+    args[end] = '\0';
+    if (!parse_index(args + num, -1, &id) || !darray_search(snapshots,
+                &id, (comparator) snapshot_has_id, &snap_idx)) {
+        command_error("no such snapshot");
+        return 0;
+    }
+    at -= 2;
+    while (at > 0 && isspace(args[at - 1])) {
+        at--;
+    }
+    args[at] = '\0';
+
+    snapshot *snap = darray_get(snapshots, snap_idx);
+    keys_select(snap);
+    *entriesp = snap->entries;
+    return 1;
+}
+
+entry *parse_entry(char **strp, darray *entries) {
+    char *key = strsep(strp, WHITESPACE);
+
+    return entries_lookup(entries, key);
+}
+
+/* Commands */
+
+void command_help() {
+    fputs(HELP_STRING, stdout);
+}
+
+void command_list(char *args, darray *snapshots, darray *entries) {
+    char *what = strsep(&args, WHITESPACE);
+    if (strcasecmp(what, "keys") == 0) {
+        char *from = NULL, *to = NULL, *prefix = NULL;
+        char *word;
+        while ((word = strsep(&args, WHITESPACE)) != NULL) {
+            if (*word == '\0') {
+                continue;
+            }
+            char *bound = strsep(&args, WHITESPACE);
+            if (bound == NULL || *bound == '\0') {
+                command_error("invalid list command");
+                return;
+            } else if (strcasecmp(word, "prefix") == 0) {
+                prefix = bound;
+            } else if (strcasecmp(word, "from") == 0) {
+                from = bound;
+            } else if (strcasecmp(word, "to") == 0) {
+                to = bound;
+            } else {
+                command_error("invalid list command");
+                return;
+            }
+        }
+        if (prefix != NULL && (from != NULL || to != NULL)) {
+            command_error("invalid list command");
+            return;
+        }
+
+        darray *found = entries;
+        if (from != NULL || to != NULL || prefix != NULL) {
+            found = entries_keys_range(entries, from, to, prefix);
+        }
+        if (darray_len(found) == 0) {
+            printf("no keys\n");
+        } else {
+            darray_foreach(found, (consumer) entry_print_key);
+        }
+        if (found != entries) {
+            del_darray(found);
+        }
+    } else if (strcasecmp(what, "entries") == 0) {
+        if (darray_len(entries) == 0) {
+            printf("no entries\n");
+        } else {
+        darray_foreach(entries, (consumer) entry_print);
+        }
+    } else if (strcasecmp(what, "snapshots") == 0) {
+        if (darray_len(snapshots) == 0) {
+            printf("no snapshots\n");
+        } else {
+            darray_foreach(snapshots, (consumer) snapshot_print);
+        }
+    } else {
+        command_error("invalid list command");
+    }
+}
+
+void command_get(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    if ((ent = parse_entry(&args, entries)) == NULL) {
+        command_error("no such key");
+        return;
+    }
+    entry_print_nokey(ent);
+}
+
+void command_del(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    if ((ent = parse_entry(&args, entries)) == NULL) {
+        command_error("no such key");
+        return;
+    }
+    if (darray_len(ent->backward) != 0) {
+        command_error("not permitted");
+        return;
+    }
+
+    size_t idx;
+    darray_search(entries, ent, compare_ptr, &idx);
+    index_entry(ent, -1);
+    keys_remove(entries, ent);
+    entry_deref_all(ent);
+    darray_pop(entries, idx);
+
+    printf("ok\n");
+}
+
+void command_purge(char *args, darray *snapshots, darray *entries) {
+    char *key = strsep(&args, WHITESPACE);
+
+    if (!entries_can_purge_key(entries, key)) {
+        command_error("not permitted");
+        return;
+    }
+    for (size_t i = 0; i < darray_len(snapshots); i++) {
+        snapshot *snap = darray_get(snapshots, i);
+        if (!entries_can_purge_key(snap->entries, key)) {
+            command_error("not permitted");
+            return;
+        }
+    }
+
+    entry *ent;
+    if ((ent = entries_lookup(entries, key)) != NULL) {
+        index_entry(ent, -1);
+    }
+    entries_purge_key(entries, key);
+    for (size_t i = 0; i < darray_len(snapshots); i++) {
+        snapshot *snap = darray_get(snapshots, i);
+        keys_forget(snap);
+        entries_purge_key(snap->entries, key);
+    }
+
+    printf("ok\n");
+}
+
+void command_set(char *args, darray *snapshots, darray *entries) {
+    char *key = strsep(&args, WHITESPACE);
+    if (key == NULL) {
+        command_error("missing key");
+        return;
+    }
+    if (!key_is_valid(key)) {
+        command_error("invalid key");
+        return;
+    }
+
+    int exist;
+    entry *ent = entries_reset(entries, key, &exist);
+    entry_assign(entries, ent, exist, parse_elements(&args, entries, ent));
+}
+
+entry *entries_reset(darray *entries, char *key, int *existp) {
+    entry *ent;
+    *existp = (ent = entries_lookup(entries, key)) != NULL;
+    if (*existp) {
+        index_entry(ent, -1);
+        entry_deref_all(ent);
+        entry_clear(ent);
+    } else {
+        ent = new_entry(key);
+    }
+
+    return ent;
+}
+
+int entry_assign(darray *entries, entry *ent, int exist, darray *elements) {
+    char error = 0;
+    if (elements == NULL) {
+        error = 1;
+    } else if (!darray_extend(ent->elements, elements)) {
+        command_error("out of memory");
+        error = 1;
+    } else if (!exist && !darray_insert(entries, 0, ent)) {
+        command_error("out of memory");
+        error = 1;
+    }
+
+    if (error) {
+        del_darray(elements);
+        if (!exist) {
+            del_entry(ent);
+        }
+        return 0;
+    }
+
+    if (!exist) {
+        keys_add(entries, ent);
+    }
+    entry_ref_all(ent, elements);
+    index_elements(ent, elements, 1);
+    entry_sketch_add(ent, elements);
+
+    del_darray(elements);
+    printf("ok\n");
+    return 1;
+}
+
+void command_push(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    if ((ent = parse_entry(&args, entries)) == NULL) {
+        command_error("no such key");
+        return;
+    }
+    entry_unpack(ent);
+
+    darray *elements = parse_elements(&args, entries, ent);
+
+    darray_reverse(elements);
+    entry_add_elements(ent, elements, 0);
+}
+
+void command_append(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    if ((ent = parse_entry(&args, entries)) == NULL) {
+        command_error("no such key");
+        return;
+    }
+    entry_unpack(ent);
+
+    darray *elements = parse_elements(&args, entries, ent);
+    if (elements == NULL) {
+        return;
+    }
+    entry_add_elements(ent, elements, darray_len(ent->elements));
+}
+
+int entry_add_elements(entry *ent, darray *elements, size_t idx) {
+    ent->sorted = 0;
+    if (!darray_extend_at(ent->elements, idx, elements)) {
+        command_error("out of memory");
+        del_darray(elements);
+        return 0;
+    }
+
+    entry_ref_all(ent, elements);
+    index_elements(ent, elements, 1);
+    entry_sketch_add(ent, elements);
+
+    del_darray(elements);
+    printf("ok\n");
+    return 1;
+}
+
+int batch_has_key(const char *key1, const char *key2) {
+    return strcmp(key1, key2);
+}
+
+darray *parse_batch(char *args) {
+    darray *batch = new_darray((consumer) del_darray);
+
+    char *segment;
+    while ((segment = strsep(&args, ";")) != NULL) {
+        darray *tokens = new_darray(NULL);
+        char *token;
+        while ((token = strsep(&segment, WHITESPACE)) != NULL) {
+            if (*token != '\0') {
+                darray_append(tokens, token);
+            }
+        }
+        if (darray_len(tokens) == 0) {
+            del_darray(tokens);
+            continue;
+        }
+        darray_append(batch, tokens);
+    }
+
+    return batch;
+}
+
+int batch_check_elements(darray *tokens, darray *entries, darray *keys) {
+    char *key = darray_get(tokens, 0);
+    size_t idx;
+    if (!key_is_valid(key)) {
+        command_error("invalid key");
+        return 0;
+    }
+    for (size_t i = 1; i < darray_len(tokens); i++) {
+        char *token = darray_get(tokens, i);
+        value num;
+        if (isdigit(*token) || *token == '-') {
+            if (!parse_decimal(token, strlen(token), &num)) {
+                command_error("invalid integer");
+                return 0;
+            }
+        } else if (strcmp(token, key) == 0) {
+            command_error("not permitted");
+            return 0;
+        } else if (entries_lookup(entries, token) == NULL
+                && (keys == NULL || !darray_search(keys,
+                        token, (comparator) batch_has_key, &idx))) {
+            command_error("no such key");
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+darray *batch_elements(darray *tokens, darray *entries) {
+    darray *elements = new_darray(NULL);
+    for (size_t i = 1; i < darray_len(tokens); i++) {
+        char *token = darray_get(tokens, i);
+        value num;
+        if (isdigit(*token) || *token == '-') {
+            parse_decimal(token, strlen(token), &num);
+            darray_append(elements, new_int_ele(num));
+        } else {
+            darray_append(elements,
+                    new_ent_ele(entries_lookup(entries, token)));
+        }
+    }
+
+    return elements;
+}
+
+void command_mget(char *args, darray *snapshots, darray *entries) {
+    char *key;
+    int found = 0;
+    while ((key = strsep(&args, WHITESPACE)) != NULL) {
+        if (*key == '\0') {
+            continue;
+        }
+        found = 1;
+        entry *ent;
+        if ((ent = entries_lookup(entries, key)) != NULL) {
+            entry_print(ent);
+        } else {
+            printf("%s nil\n", key);
+        }
+    }
+
+    if (!found) {
+        command_error("missing key");
+    }
+}
+
+void command_mset(char *args, darray *snapshots, darray *entries) {
+    darray *batch = parse_batch(args);
+    if (darray_len(batch) == 0) {
+        command_error("missing key");
+        del_darray(batch);
+        return;
+    }
+
+    darray *keys = new_darray(NULL);
+    for (size_t i = 0; i < darray_len(batch); i++) {
+        darray *tokens = darray_get(batch, i);
+        if (!batch_check_elements(tokens, entries, keys)) {
+            del_darray(keys);
+            del_darray(batch);
+            return;
+        }
+        darray_append(keys, darray_get(tokens, 0));
+    }
+    del_darray(keys);
+
+    /* Links are deferred until every entry of the batch holds its values. */
+    darray *pending = new_darray(NULL);
+    for (size_t i = 0; i < darray_len(batch); i++) {
+        darray *tokens = darray_get(batch, i);
+        char *key = darray_get(tokens, 0);
+        size_t idx;
+        entry *ent;
+        if ((ent = entries_lookup(entries, key)) == NULL) {
+            ent = new_entry(key);
+            darray_insert(entries, 0, ent);
+            keys_add(entries, ent);
+            darray_append(pending, ent);
+        } else if (!darray_search(pending,
+                    ent, compare_ptr, &idx)) {
+            index_entry(ent, -1);
+            entry_deref_all(ent);
+            entry_clear(ent);
+            darray_append(pending, ent);
+        } else {
+            entry_clear(ent);
+        }
+
+        darray *elements = batch_elements(tokens, entries);
+        darray_extend(ent->elements, elements);
+        del_darray(elements);
+    }
+
+    for (size_t i = 0; i < darray_len(pending); i++) {
+        entry *ent = darray_get(pending, i);
+        entry_ref_all(ent, ent->elements);
+        index_elements(ent, ent->elements, 1);
+        entry_sketch_add(ent, ent->elements);
+    }
+    del_darray(pending);
+    del_darray(batch);
+
+    printf("ok\n");
+}
+
+void command_mappend(char *args, darray *snapshots, darray *entries) {
+    darray *batch = parse_batch(args);
+    if (darray_len(batch) == 0) {
+        command_error("missing key");
+        del_darray(batch);
+        return;
+    }
+
+    darray *targets = new_darray(NULL);
+    for (size_t i = 0; i < darray_len(batch); i++) {
+        darray *tokens = darray_get(batch, i);
+        entry *ent = entries_lookup(entries, darray_get(tokens, 0));
+        if (ent == NULL) {
+            command_error("no such key");
+            del_darray(targets);
+            del_darray(batch);
+            return;
+        }
+        if (!batch_check_elements(tokens, entries, NULL)) {
+            del_darray(targets);
+            del_darray(batch);
+            return;
+        }
+        darray_append(targets, ent);
+    }
+
+    darray *appended = new_darray((consumer) del_darray);
+    for (size_t i = 0; i < darray_len(batch); i++) {
+        darray *tokens = darray_get(batch, i);
+        entry *ent = darray_get(targets, i);
+        entry_unpack(ent);
+        ent->sorted = 0;
+
+        darray *elements = batch_elements(tokens, entries);
+        darray_extend(ent->elements, elements);
+        darray_append(appended, elements);
+    }
+
+    for (size_t i = 0; i < darray_len(targets); i++) {
+        entry *ent = darray_get(targets, i);
+        entry_ref_all(ent, darray_get(appended, i));
+        index_elements(ent, darray_get(appended, i), 1);
+        entry_sketch_add(ent, darray_get(appended, i));
+    }
+    del_darray(appended);
+    del_darray(targets);
+    del_darray(batch);
+
+    printf("ok\n");
+}
+
+void command_pick(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    size_t idx;
+
+    if ((ent = parse_entry(&args, entries)) == NULL) {
+        command_error("no such key");
+        return;
+    }
+
+    if (!parse_index(args, entry_count(ent), &idx)) {
+        command_error("index out of range");
+        return;
+    }
+    idx--;
+
+    if (ent->packed != NULL) {
+        printf(VALUE_FMT "\n", encoded_get(ent->packed, idx));
+        return;
+    }
+    element_print(darray_get(ent->elements, idx));
+    putchar('\n');
+}
+
+void command_pluck(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    size_t idx;
+
+    if ((ent = parse_entry(&args, entries)) == NULL) {
+        command_error("no such key");
+        return;
+    }
+    entry_unpack(ent);
+
+    if (!parse_index(args, darray_len(ent->elements), &idx)) {
+        command_error("index out of range");
+        return;
+    }
+    idx--;
+
+    element *ele = darray_get(ent->elements, idx);
+    element_print(ele);
+    putchar('\n');
+
+    if (ele != NULL && ele->type == ENTRY) {
+        entry_del_ref(ent, ele->value.entry);
+    } else if (ele != NULL) {
+        index_adjust(ent, ele->value.num, -1);
+        entry_sketch_stale(ent);
+    }
+    darray_pop(ent->elements, idx);
+}
+
+void command_pop(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+
+    if ((ent = parse_entry(&args, entries)) == NULL) {
+        command_error("no such key");
+        return;
+    }
+    entry_unpack(ent);
+
+    element *ele = darray_get(ent->elements, 0);
+    element_print(ele);
+    putchar('\n');
+
+    if (ele != NULL && ele->type == ENTRY) {
+        entry_del_ref(ent, ele->value.entry);
+    } else if (ele != NULL) {
+        index_adjust(ent, ele->value.num, -1);
+        entry_sketch_stale(ent);
+    }
+    darray_pop(ent->elements, 0);
+}
+
+void command_drop(char *args, darray *snapshots, darray *entries) {
+    size_t idx, snap_idx = 0;
+
+    if (!parse_index(args, -1, &idx)) {
+        command_error("index out of range");
+        return;
+    }
+    if (!darray_search(snapshots,
+                &idx, (comparator) snapshot_has_id, &snap_idx)) {
+        command_error("no such snapshot");
+        return;
+    }
+
+    darray_pop(snapshots, snap_idx);
+
+    printf("ok\n");
+}
+
+void command_rollback(char *args, darray *snapshots, darray *entries) {
+    size_t idx, snap_idx = 0;
+
+    if (!parse_index(args, -1, &idx)) {
+        command_error("index out of range");
+        return;
+    }
+    if (!darray_search(snapshots,
+                &idx, (comparator) snapshot_has_id, &snap_idx)) {
+        command_error("no such snapshot");
+        return;
+    }
+
+    snapshot *snap = darray_get(snapshots, snap_idx);
+    darray *clone = entries_clone(snap->entries);
+    darray_clear(entries);
+    darray_extend(entries, clone);
+    darray_set_item_free(clone, NULL);
+    del_darray(clone);
+    index_rebuild(entries);
+    keys_rebuild(entries);
+
+    darray_pop_range(snapshots, 0, snap_idx);
+
+    printf("ok\n");
+}
+
+void command_checkout(char *args, darray *snapshots, darray *entries) {
+    size_t idx, snap_idx = 0;
+
+    if (!parse_index(args, -1, &idx)) {
+        command_error("index out of range");
+        return;
+    }
+    if (!darray_search(snapshots,
+                &idx, (comparator) snapshot_has_id, &snap_idx)) {
+        command_error("no such snapshot");
+        return;
+    }
+
+    snapshot *snap = darray_get(snapshots, snap_idx);
+    darray *clone = entries_clone(snap->entries);
+    darray_clear(entries);
+    darray_extend(entries, clone);
+    darray_set_item_free(clone, NULL);
+    del_darray(clone);
+    index_rebuild(entries);
+    keys_rebuild(entries);
+
+    printf("ok\n");
+}
+
+void command_snapshot(char *args, darray *snapshots, darray *entries) {
+    snapshot *snap = new_snapshot(entries);
+    darray_insert(snapshots, 0, snap);
+    snapshots_retain(snapshots);
+
+    printf("saved as snapshot ");
+    snapshot_print(snap);
+}
+
+void command_retain(char *args, darray *snapshots, darray *entries) {
+    char *what = strsep(&args, WHITESPACE);
+    char *num_str = strsep(&args, WHITESPACE);
+    size_t *setting;
+    size_t unset;
+    if (what == NULL || *what == '\0') {
+        if (retain_last == SIZE_MAX) {
+            printf("last all\n");
+        } else {
+            printf("last %zu\n", retain_last);
+        }
+        if (retain_every == 0) {
+            printf("every none\n");
+        } else {
+            printf("every %zu seconds\n", retain_every);
+        }
+        if (retain_cost == SIZE_MAX) {
+            printf("cost none\n");
+        } else {
+            printf("cost %zu\n", retain_cost);
+        }
+        return;
+    } else if (strcasecmp(what, "last") == 0) {
+        setting = &retain_last;
+        unset = SIZE_MAX;
+    } else if (strcasecmp(what, "every") == 0) {
+        setting = &retain_every;
+        unset = 0;
+    } else if (strcasecmp(what, "cost") == 0) {
+        setting = &retain_cost;
+        unset = SIZE_MAX;
+    } else {
+        command_error("invalid retain command");
+        return;
+    }
+
+    size_t num;
+    if (num_str != NULL && (strcasecmp(num_str, "all") == 0
+                || strcasecmp(num_str, "none") == 0)) {
+        *setting = unset;
+    } else if (parse_index(num_str, SIZE_MAX - 1, &num)) {
+        *setting = num;
+    } else {
+        command_error("invalid number");
+        return;
+    }
+    snapshots_retain(snapshots);
+
+    printf("ok\n");
+}
+
+void command_save(char *args, darray *snapshots, darray *entries) {
+    size_t idx, snap_idx = 0;
+
+    if (!parse_index(strsep(&args, WHITESPACE), -1, &idx)) {
+        command_error("index out of range");
+        return;
+    }
+    if (!darray_search(snapshots,
+                &idx, (comparator) snapshot_has_id, &snap_idx)) {
+        command_error("no such snapshot");
+        return;
+    }
+
+    char *path = strsep(&args, WHITESPACE);
+    if (path == NULL || *path == '\0') {
+        command_error("missing path");
+        return;
+    }
+
+    snapshot *snap = darray_get(snapshots, snap_idx);
+    save_poll(0);
+    if (!entries_save(snap->entries, path)) {
+        command_error("save in progress");
+        return;
+    }
+
+    printf("ok\n");
+}
+
+void command_bgsave(char *args, darray *snapshots, darray *entries) {
+    char *path = strsep(&args, WHITESPACE);
+    if (path == NULL || *path == '\0') {
+        command_error("missing path");
+        return;
+    }
+
+    save_poll(0);
+    if (!entries_save(entries, path)) {
+        command_error("save in progress");
+        return;
+    }
+
+    printf("ok\n");
+}
+
+void command_load(char *args, darray *snapshots, darray *entries) {
+    char *path = strsep(&args, WHITESPACE);
+    if (path == NULL || *path == '\0') {
+        command_error("missing path");
+        return;
+    }
+
+    /* A file still being saved in the background is read once it is whole. */
+    if (last_save.pid != 0 && strcmp(last_save.path, path) == 0) {
+        save_poll(1);
+    }
+
+    char error[BUFLEN + 32];
+    darray *changed = new_darray(NULL);
+    if (!entries_load(entries, path, changed, error, sizeof(error))) {
+        command_error(error);
+        del_darray(changed);
+        return;
+    }
+
+    /* Followers may not see the same file, so they are sent what changed. */
+    replica_send_entries(-1, changed);
+    del_darray(changed);
+    printf("ok\n");
+}
+
+void command_publish(char *args, darray *snapshots, darray *entries) {
+    size_t idx, snap_idx = 0;
+
+    if (!parse_index(strsep(&args, WHITESPACE), -1, &idx)) {
+        command_error("index out of range");
+        return;
+    }
+    if (!darray_search(snapshots,
+                &idx, (comparator) snapshot_has_id, &snap_idx)) {
+        command_error("no such snapshot");
+        return;
+    }
+
+    char name[NAME_MAX];
+    char *name_str = strsep(&args, WHITESPACE);
+    if (name_str == NULL || *name_str == '\0') {
+        snprintf(name, sizeof(name), "/integerdb-%d-%zu", (int) getpid(), idx);
+    } else if (name_str[0] != '/' || strchr(name_str + 1, '/') != NULL
+            || strlen(name_str) < 2 || strlen(name_str) >= sizeof(name)) {
+        command_error("invalid name");
+        return;
+    } else {
+        strcpy(name, name_str);
+    }
+
+    if (!snapshot_publish(darray_get(snapshots, snap_idx), name)) {
+        char message[NAME_MAX + 16];
+        snprintf(message, sizeof(message), "can not publish %s", name);
+        command_error(message);
+        return;
+    }
+    if (published == NULL) {
+        published = new_darray(free);
+    }
+    if (!darray_search(published, name, (comparator) strcmp, &snap_idx)) {
+        darray_append(published, strdup(name));
+    }
+
+    printf("%s\n", name);
+}
+
+void command_image(char *args, darray *snapshots, darray *entries) {
+    char *name = strsep(&args, WHITESPACE);
+    if (name == NULL || *name == '\0') {
+        command_error("missing name");
+        return;
+    }
+    image *img = image_open(name);
+    if (img == NULL) {
+        command_error("no such image");
+        return;
+    }
+
+    char *key = strsep(&args, WHITESPACE);
+    size_t idx;
+    if (key == NULL || *key == '\0') {
+        if (image_len(img) == 0) {
+            printf("no keys\n");
+        }
+        for (size_t i = 0; i < image_len(img); i++) {
+            printf("%s\n", image_name(img, i));
+        }
+    } else if (!image_find(img, key, &idx)) {
+        command_error("no such key");
+    } else {
+        size_t nums_len, links_len;
+        const value *nums = image_ints(img, idx, &nums_len);
+        const image_ref *links = image_links(img, idx, &links_len);
+
+        /* References are put back at their positions among the integers. */
+        size_t num = 0, link = 0;
+        printf("[");
+        for (size_t pos = 0; num < nums_len || link < links_len; pos++) {
+            if (pos > 0) {
+                putchar(' ');
+            }
+            if (link < links_len && links[link].pos == pos) {
+                printf("%s", image_name(img, links[link++].key));
+            } else {
+                printf(VALUE_FMT, nums[num++]);
+            }
+        }
+        printf("]\n");
+    }
+    image_close(img);
+}
+
+void command_lastsave(char *args, darray *snapshots, darray *entries) {
+    if (save_poll(0)) {
+        char tmp[BUFLEN + 4];
+        struct stat st;
+        snprintf(tmp, sizeof(tmp), "%s.tmp", last_save.path);
+        if (stat(tmp, &st) != 0) {
+            st.st_size = 0;
+        }
+        printf("in progress, %lld bytes written\n", (long long) st.st_size);
+    } else if (last_save.path[0] == '\0') {
+        printf("no save\n");
+    } else if (last_save.failed) {
+        printf("failed to save %s\n", last_save.path);
+    } else {
+        double rate = last_save.seconds > 0
+            ? last_save.bytes / last_save.seconds / 1e6 : 0;
+        printf("saved %zu bytes to %s in %.3f seconds (%.1f MB/s)\n",
+                last_save.bytes, last_save.path, last_save.seconds, rate);
+    }
+}
+
+void command_gc(char *args, darray *snapshots, darray *entries) {
+    char *mode = strsep(&args, WHITESPACE);
+    if (mode == NULL || *mode == '\0') {
+        printf("%zu entries pending, cost %zu\n",
+                garbage == NULL ? 0 : darray_len(garbage), garbage_cost);
+        printf("%zu entries reclaimed\n", garbage_reclaimed);
+        if (garbage_limit == SIZE_MAX) {
+            printf("no limit\n");
+        } else {
+            printf("limit %zu\n", garbage_limit);
+        }
+    } else if (strcasecmp(mode, "run") == 0) {
+        gc_step(SIZE_MAX);
+        printf("ok\n");
+    } else if (strcasecmp(mode, "limit") == 0) {
+        size_t limit;
+        char *limit_str = strsep(&args, WHITESPACE);
+        if (limit_str != NULL && strcasecmp(limit_str, "none") == 0) {
+            garbage_limit = SIZE_MAX;
+        } else if (parse_index(limit_str, SIZE_MAX, &limit)) {
+            garbage_limit = limit;
+            if (garbage_cost > garbage_limit) {
+                gc_step(garbage_cost - garbage_limit);
+            }
+        } else {
+            command_error("invalid limit");
+            return;
+        }
+        printf("ok\n");
+    } else {
+        command_error("invalid gc command");
+    }
+}
+
+void command_slowlog(char *args, darray *snapshots, darray *entries) {
+    char *what = strsep(&args, WHITESPACE);
+    if (what == NULL || *what == '\0') {
+        slowlog_print();
+    } else if (strcasecmp(what, "len") == 0) {
+        printf("%zu\n", slowlog_len);
+    } else if (strcasecmp(what, "reset") == 0) {
+        slowlog_len = 0;
+        printf("ok\n");
+    } else if (strcasecmp(what, "threshold") == 0) {
+        char *micros_str = strsep(&args, WHITESPACE);
+        value micros;
+        if (micros_str == NULL || *micros_str == '\0') {
+            if (slowlog_threshold < 0) {
+                printf("no threshold\n");
+            } else {
+                printf("threshold %lld us\n", slowlog_threshold);
+            }
+            return;
+        }
+        if (strcasecmp(micros_str, "none") == 0) {
+            slowlog_threshold = -1;
+        } else if (parse_int(micros_str, &micros) && micros >= 0) {
+            slowlog_threshold = micros;
+        } else {
+            command_error("invalid threshold");
+            return;
+        }
+        printf("ok\n");
+    } else {
+        command_error("invalid slowlog command");
+    }
+}
+
+void command_memory(char *args, darray *snapshots, darray *entries) {
+    char *what = strsep(&args, WHITESPACE);
+    if (what == NULL || *what == '\0') {
+        command_error("invalid memory command");
+    } else if (strcasecmp(what, "total") == 0) {
+        size_t state = entries_memory(entries);
+        size_t snaps = darray_bytes(snapshots);
+        for (size_t i = 0; i < darray_len(snapshots); i++) {
+            snaps += snapshot_memory(darray_get(snapshots, i));
+        }
+        size_t trash = garbage == NULL ? 0 : entries_memory(garbage);
+        size_t index = index_memory();
+        printf("current state %zu bytes\n", state);
+        printf("snapshots %zu bytes\n", snaps);
+        printf("garbage %zu bytes\n", trash);
+        printf("value index %zu bytes\n", index);
+        printf("total %zu bytes\n", state + snaps + trash + index);
+    } else if (strcasecmp(what, "snapshot") == 0) {
+        size_t idx, snap_idx = 0;
+        if (!parse_index(strsep(&args, WHITESPACE), -1, &idx)) {
+            command_error("index out of range");
+        } else if (!darray_search(snapshots,
+                    &idx, (comparator) snapshot_has_id, &snap_idx)) {
+            command_error("no such snapshot");
+        } else {
+            printf("%zu bytes\n",
+                    snapshot_memory(darray_get(snapshots, snap_idx)));
+        }
+    } else if (strcasecmp(what, "top") == 0) {
+        size_t len = TOPLEN;
+        char *len_str = strsep(&args, WHITESPACE);
+        if (len_str != NULL && *len_str != '\0'
+                && !parse_index(len_str, -1, &len)) {
+            command_error("index out of range");
+            return;
+        }
+        if (darray_len(entries) == 0) {
+            printf("no keys\n");
+            return;
+        }
+
+        size_t count = darray_len(entries);
+        usage *uses = (usage *) malloc(count * sizeof(usage));
+        for (size_t i = 0; i < count; i++) {
+            uses[i].ent = darray_get(entries, i);
+            uses[i].bytes = entry_memory(uses[i].ent);
+        }
+        qsort(uses, count, sizeof(usage),
+                (int (*)(const void *, const void *)) usage_cmp);
+        for (size_t i = 0; i < count && i < len; i++) {
+            printf("%s %zu bytes\n", uses[i].ent->key, uses[i].bytes);
+        }
+        free(uses);
+    } else {
+        entry *ent;
+        if ((ent = entries_lookup(entries, what)) == NULL) {
+            command_error("no such key");
+            return;
+        }
+        printf("%zu bytes\n", entry_memory(ent));
+    }
+}
+
+void command_min(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    if ((ent = parse_entry(&args, entries)) == NULL) {
+        command_error("no such key");
+        return;
+    }
+    printf(VALUE_FMT "\n", entry_min(ent));
+}
+
+void command_max(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    if ((ent = parse_entry(&args, entries)) == NULL) {
+        command_error("no such key");
+        return;
+    }
+    printf(VALUE_FMT "\n", entry_max(ent));
+}
+
+void command_sum(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    if ((ent = parse_entry(&args, entries)) == NULL) {
+        command_error("no such key");
+        return;
+    }
+    stats st = entry_stats(ent);
+    if (st.overflow) {
+        printf("overflow\n");
+    } else {
+        total_print(st.sum);
+        putchar('\n');
+    }
+}
+
+void command_len(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    if ((ent = parse_entry(&args, entries)) == NULL) {
+        command_error("no such key");
+        return;
+    }
+    printf("%zu\n", entry_len(ent));
+}
+
+void command_rev(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    if ((ent = parse_entry(&args, entries)) == NULL) {
+        command_error("no such key");
+        return;
+    }
+
+    if (!entry_is_simple(ent)) {
+        command_error("entry is not simple");
+        return;
+    }
+    entry_unpack(ent);
+
+    darray_reverse(ent->elements);
+    ent->sorted = 0;
+    printf("ok\n");
+}
+
+void command_uniq(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    if ((ent = parse_entry(&args, entries)) == NULL) {
+        command_error("no such key");
+        return;
+    }
+
+    if (!entry_is_simple(ent)) {
+        puts("entry is not simple");
+        return;
+    }
+    entry_unpack(ent);
+
+    index_entry(ent, -1);
+    darray_unique(ent->elements, (comparator) element_int_cmp);
+    index_entry(ent, 1);
+    entry_sketch_stale(ent);
+    entry_pack(ent);
+    printf("ok\n");
+}
+
+void command_sort(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    if ((ent = parse_entry(&args, entries)) == NULL) {
+        command_error("no such key");
+        return;
+    }
+
+    if (!entry_is_simple(ent)) {
+        puts("entry is not simple");
+        return;
+    }
+    entry_unpack(ent);
+
+    darray_sort(ent->elements, (comparator) element_int_cmp);
+    ent->sorted = 1;
+    entry_pack(ent);
+    printf("ok\n");
+}
+
+entry *parse_simple_entry(char **strp, darray *entries) {
+    entry *ent;
+    if ((ent = parse_entry(strp, entries)) == NULL) {
+        command_error("no such key");
+        return NULL;
+    }
+    if (!entry_is_simple(ent)) {
+        command_error("entry is not simple");
+        return NULL;
+    }
+
+    return ent;
+}
+
+void command_rank(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    if ((ent = parse_simple_entry(&args, entries)) == NULL) {
+        return;
+    }
+
+    char *num_str = strsep(&args, WHITESPACE);
+    value num;
+    if (num_str == NULL || !parse_int(num_str, &num)) {
+        command_error("invalid integer");
+        return;
+    }
+
+    printf("%zu\n", entry_rank(ent, num, 0));
+}
+
+void command_count(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    if ((ent = parse_simple_entry(&args, entries)) == NULL) {
+        return;
+    }
+
+    char *lo_str = strsep(&args, WHITESPACE);
+    char *hi_str = strsep(&args, WHITESPACE);
+    value lo, hi;
+    if (lo_str == NULL || !parse_int(lo_str, &lo)
+            || hi_str == NULL || !parse_int(hi_str, &hi)) {
+        command_error("invalid integer");
+        return;
+    }
+
+    size_t below = entry_rank(ent, lo, 0);
+    size_t upto = entry_rank(ent, hi, 1);
+    printf("%zu\n", upto > below ? upto - below : 0);
+}
+
+void command_contains(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    if ((ent = parse_simple_entry(&args, entries)) == NULL) {
+        return;
+    }
+
+    char *num_str = strsep(&args, WHITESPACE);
+    value num;
+    if (num_str == NULL || !parse_int(num_str, &num)) {
+        command_error("invalid integer");
+        return;
+    }
+
+    printf("%s\n", entry_rank(ent, num, 1) > entry_rank(ent, num, 0)
+            ? "yes" : "no");
+}
+
+void command_percentile(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    if ((ent = parse_simple_entry(&args, entries)) == NULL) {
+        return;
+    }
+
+    char *p_str = strsep(&args, WHITESPACE);
+    value p;
+    if (p_str == NULL || !parse_int(p_str, &p) || p < 0 || p > 100) {
+        command_error("invalid percentile");
+        return;
+    }
+
+    size_t len = entry_count(ent);
+    if (len == 0) {
+        printf("nil\n");
+        return;
+    }
+
+    /* The nearest rank: the smallest value with p percent at or below it. */
+    size_t rank = (len * p + 99) / 100;
+    printf(VALUE_FMT "\n", entry_select(ent, rank == 0 ? 0 : rank - 1));
+}
+
+entry *parse_transform(char **strp, darray *entries, value **numsp) {
+    entry *ent;
+    if ((ent = parse_simple_entry(strp, entries)) == NULL) {
+        return NULL;
+    }
+
+    if ((*numsp = entry_nums(ent)) == NULL) {
+        command_error("out of memory");
+        return NULL;
+    }
+
+    return ent;
+}
+
+void entry_transformed(entry *ent, value *nums, size_t len) {
+    index_entry(ent, -1);
+    entry_store_nums(ent, nums, len);
+    entry_pack(ent);
+    index_entry(ent, 1);
+    entry_sketch_stale(ent);
+    free(nums);
+    printf("ok\n");
+}
+
+void command_add(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    value *nums;
+    if ((ent = parse_transform(&args, entries, &nums)) == NULL) {
+        return;
+    }
+
+    char *num_str = strsep(&args, WHITESPACE);
+    value num;
+    if (num_str == NULL || !parse_int(num_str, &num)) {
+        command_error("invalid integer");
+        free(nums);
+        return;
+    }
+    if (!nums_add(nums, entry_count(ent), num)) {
+        command_error("overflow");
+        free(nums);
+        return;
+    }
+
+    entry_transformed(ent, nums, entry_count(ent));
 }
 
-void del_snapshot(snapshot *snap) {
-    del_darray(snap->entries);
-    free(snap);
+void command_mul(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    value *nums;
+    if ((ent = parse_transform(&args, entries, &nums)) == NULL) {
+        return;
+    }
+
+    char *num_str = strsep(&args, WHITESPACE);
+    value num;
+    if (num_str == NULL || !parse_int(num_str, &num)) {
+        command_error("invalid integer");
+        free(nums);
+        return;
+    }
+    if (!nums_mul(nums, entry_count(ent), num)) {
+        command_error("overflow");
+        free(nums);
+        return;
+    }
+
+    if (num < 0) {
+        ent->sorted = 0;
+    }
+    entry_transformed(ent, nums, entry_count(ent));
 }
 
-/* Helper parsers */
+void command_clamp(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    value *nums;
+    if ((ent = parse_transform(&args, entries, &nums)) == NULL) {
+        return;
+    }
 
-int parse_int(char *str, int *resp) {
-    char *end;
-    long num = strtol(str, &end, 10);
-    if (end == str || *end != '\0' || num < INT_MIN || num > INT_MAX) {
-        return 0;
+    char *lo_str = strsep(&args, WHITESPACE);
+    char *hi_str = strsep(&args, WHITESPACE);
+    value lo, hi;
+    if (lo_str == NULL || !parse_int(lo_str, &lo)
+            || hi_str == NULL || !parse_int(hi_str, &hi)) {
+        command_error("invalid integer");
+        free(nums);
+        return;
     }
-    *resp = num;
-    return 1;
+    if (lo > hi) {
+        command_error("invalid range");
+        free(nums);
+        return;
+    }
+
+    nums_clamp(nums, entry_count(ent), lo, hi);
+    entry_transformed(ent, nums, entry_count(ent));
 }
 
-int parse_index(char *str, size_t max, size_t *resp) {
-    if (str == NULL) {
-        return 0;
+void command_filter(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    value *nums;
+    if ((ent = parse_transform(&args, entries, &nums)) == NULL) {
+        return;
     }
 
-    char *end;
-    unsigned long num = strtoul(str, &end, 10);
-    if (end == str || *end != '\0' || num == 0 || num > max) {
-        return 0;
+    char *what = strsep(&args, WHITESPACE);
+    int cmp;
+    if (what != NULL && strcasecmp(what, "gt") == 0) {
+        cmp = 1;
+    } else if (what != NULL && strcasecmp(what, "lt") == 0) {
+        cmp = -1;
+    } else if (what != NULL && strcasecmp(what, "eq") == 0) {
+        cmp = 0;
+    } else {
+        command_error("invalid filter");
+        free(nums);
+        return;
     }
-    *resp = num;
-    return 1;
+
+    char *num_str = strsep(&args, WHITESPACE);
+    value num;
+    if (num_str == NULL || !parse_int(num_str, &num)) {
+        command_error("invalid integer");
+        free(nums);
+        return;
+    }
+
+    size_t len = nums_filter(nums, entry_count(ent), cmp, num);
+    entry_transformed(ent, nums, len);
 }
 
-darray *parse_elements(char **strp, darray *entries, entry *self) {
-    darray *elements = new_darray(free);
+void command_combine(char *args, darray *entries, set_kernel kernel) {
+    char *key = strsep(&args, WHITESPACE);
+    if (key == NULL || *key == '\0') {
+        command_error("missing key");
+        return;
+    }
+    if (!key_is_valid(key)) {
+        command_error("invalid key");
+        return;
+    }
 
+    darray *sources = new_darray(NULL);
     char *token;
-    size_t idx;
-    while ((token = strsep(strp, WHITESPACE)) != NULL) {
-        int num;
-        element *ele;
-        if (isdigit(*token) || *token == '-') {
-            if (parse_int(token, &num)) {
-                ele = new_int_ele(num);
-            } else {
-                printf("invalid integer\n");
-                del_darray(elements);
-                return NULL;
-            }
+    while ((token = strsep(&args, WHITESPACE)) != NULL) {
+        if (*token == '\0') {
+            continue;
         }
-        else {
-            if (strcmp(token, self->key) == 0) {
-                printf("not permitted\n");
-                del_darray(elements);
-                return NULL;
-            }
-            if (!darray_search(entries, token, (comparator) entry_has_key, &idx)) {
-                printf("no such key\n");
-                del_darray(elements);
-                return NULL;
-            }
-            entry *ent = darray_get(entries, idx);
-            ele = new_ent_ele(ent);
+        entry *ent = entries_lookup(entries, token);
+        if (ent == NULL) {
+            command_error("no such key");
+            del_darray(sources);
+            return;
         }
-        darray_append(elements, ele);
+        if (!entry_is_simple(ent)) {
+            command_error("entry is not simple");
+            del_darray(sources);
+            return;
+        }
+        darray_append(sources, ent);
+    }
+    if (darray_len(sources) == 0) {
+        command_error("missing key");
+        del_darray(sources);
+        return;
     }
 
-    darray_set_item_free(elements, NULL);
+    /* Each source is folded into the result, which stays sorted and unique. */
+    size_t len;
+    value *result = entry_set(darray_get(sources, 0), &len);
+    for (size_t i = 1; result != NULL && i < darray_len(sources); i++) {
+        size_t other_len;
+        value *other = entry_set(darray_get(sources, i), &other_len);
+        value *out = other == NULL ? NULL
+            : (value *) malloc((len + other_len + 1) * sizeof(value));
+        if (out != NULL) {
+            len = kernel(result, len, other, other_len, out);
+        }
+        free(result);
+        free(other);
+        result = out;
+    }
+    del_darray(sources);
+    if (result == NULL) {
+        command_error("out of memory");
+        return;
+    }
 
-    return elements;
-}
+    entry *ent = entries_lookup(entries, key);
+    if (ent != NULL) {
+        index_entry(ent, -1);
+        entry_deref_all(ent);
+        entry_clear(ent);
+    } else {
+        ent = new_entry(key);
+        darray_insert(entries, 0, ent);
+        keys_add(entries, ent);
+    }
 
-entry *parse_entry(char **strp, darray *entries) {
-    char *key = strsep(strp, WHITESPACE);
-    size_t idx;
-    if (!darray_search(entries, key, (comparator) entry_has_key, &idx)) {
-        return NULL;
+    darray *elements = new_darray(NULL);
+    for (size_t i = 0; i < len; i++) {
+        darray_append(elements, new_int_ele(result[i]));
     }
+    free(result);
+    darray_extend(ent->elements, elements);
+    index_elements(ent, elements, 1);
+    entry_sketch_add(ent, elements);
+    del_darray(elements);
+    ent->sorted = 1;
+    entry_pack(ent);
 
-    return darray_get(entries, idx);
+    printf("ok\n");
 }
 
-/* Commands */
-
-void command_help() {
-    fputs(HELP_STRING, stdout);
+void command_union(char *args, darray *snapshots, darray *entries) {
+    command_combine(args, entries, nums_union);
 }
 
-void command_list(char *args, darray *snapshots, darray *entries) {
-    char *what = strsep(&args, WHITESPACE);
-    if (strcasecmp(what, "keys") == 0) {
-        if (darray_len(entries) == 0) {
-            printf("no keys\n");
-        } else {
-            darray_foreach(entries, (consumer) entry_print_key);
-        }
-    } else if (strcasecmp(what, "entries") == 0) {
-        if (darray_len(entries) == 0) {
-            printf("no entries\n");
-        } else {
-        darray_foreach(entries, (consumer) entry_print);
-        }
-    } else if (strcasecmp(what, "snapshots") == 0) {
-        if (darray_len(snapshots) == 0) {
-            printf("no snapshots\n");
-        } else {
-            darray_foreach(snapshots, (consumer) snapshot_print);
-        }
-    } else {
-        printf("invalid list command\n");
-    }
+void command_intersect(char *args, darray *snapshots, darray *entries) {
+    command_combine(args, entries, nums_intersect);
 }
 
-void command_get(char *args, darray *snapshots, darray *entries) {
-    entry *ent;
-    if ((ent = parse_entry(&args, entries)) == NULL) {
-        printf("no such key\n");
-        return;
-    }
-    entry_print_nokey(ent);
+void command_diff(char *args, darray *snapshots, darray *entries) {
+    command_combine(args, entries, nums_diff);
 }
 
-void command_del(char *args, darray *snapshots, darray *entries) {
+void command_sketch(char *args, darray *snapshots, darray *entries) {
     entry *ent;
     if ((ent = parse_entry(&args, entries)) == NULL) {
-        printf("no such key\n");
+        command_error("no such key");
         return;
     }
-    if (darray_len(ent->backward) != 0) {
-        printf("not permitted\n");
+
+    char *what = strsep(&args, WHITESPACE);
+    if (what != NULL && strcasecmp(what, "on") == 0) {
+        if (ent->sketch == NULL) {
+            ent->sketch = new_sketch();
+            sketch_mark_stale(ent->sketch);
+            entry_sketch(ent);
+        }
+    } else if (what != NULL && strcasecmp(what, "off") == 0) {
+        del_sketch(ent->sketch);
+        ent->sketch = NULL;
+    } else {
+        command_error("invalid sketch command");
         return;
     }
 
-    size_t idx;
-    darray_search(entries, ent, compare_ptr, &idx);
-    entry_deref_all(ent);
-    darray_pop(entries, idx);
-
     printf("ok\n");
 }
 
-void command_purge(char *args, darray *snapshots, darray *entries) {
-    char *key = strsep(&args, WHITESPACE);
-
-    if (!entries_can_purge_key(entries, key)) {
-        printf("not permitted\n");
+void command_distinct(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    if ((ent = parse_simple_entry(&args, entries)) == NULL) {
         return;
     }
-    for (size_t i = 0; i < darray_len(snapshots); i++) {
-        snapshot *snap = darray_get(snapshots, i);
-        if (!entries_can_purge_key(snap->entries, key)) {
-            printf("not permitted\n");
-            return;
-        }
+
+    sketch *sk = entry_sketch(ent);
+    if (sk != NULL) {
+        printf("%zu\n", sketch_distinct(sk));
+        return;
     }
 
-    entries_purge_key(entries, key);
-    for (size_t i = 0; i < darray_len(snapshots); i++) {
-        snapshot *snap = darray_get(snapshots, i);
-        entries_purge_key(snap->entries, key);
+    size_t len = entry_count(ent);
+    value *nums = entry_nums(ent);
+    if (nums == NULL) {
+        command_error("out of memory");
+        return;
+    }
+    if (!ent->sorted) {
+        qsort(nums, len, sizeof(value),
+                (int (*)(const void *, const void *)) value_cmp);
     }
+    size_t distinct = 0;
+    for (size_t i = 0; i < len; i++) {
+        distinct += i == 0 || nums[i] != nums[i - 1];
+    }
+    free(nums);
 
-    printf("ok\n");
+    printf("%zu\n", distinct);
 }
 
-void command_set(char *args, darray *snapshots, darray *entries) {
-    char *key = strsep(&args, WHITESPACE);
-    if (key == NULL) {
-        printf("missing key\n");
+void command_quantile(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    if ((ent = parse_simple_entry(&args, entries)) == NULL) {
         return;
     }
 
-    char exist;
-    size_t idx = 0;
-    entry *ent;
-    exist = darray_search(entries, key, (comparator) entry_has_key, &idx);
-    if (exist) {
-        ent = darray_get(entries, idx);
-        entry_deref_all(ent);
-        darray_clear(ent->elements);
-    } else {
-        ent = new_entry(key);
+    char *q_str = strsep(&args, WHITESPACE);
+    char *end;
+    double q = q_str == NULL ? -1 : strtod(q_str, &end);
+    if (q_str == NULL || end == q_str || *end != '\0' || !(q >= 0 && q <= 1)) {
+        command_error("invalid quantile");
+        return;
     }
 
-    darray *elements;
-    char error = 0;
-    if ((elements = parse_elements(&args, entries, ent)) == NULL) {
-        error = 1;
+    size_t len = entry_count(ent);
+    if (len == 0) {
+        printf("nil\n");
+        return;
     }
 
-    if (!darray_extend(ent->elements, elements)) {
-        printf("out of memory\n");
-        error = 1;
+    sketch *sk = entry_sketch(ent);
+    if (sk != NULL) {
+        printf(VALUE_FMT "\n", sketch_quantile(sk, q));
+        return;
     }
 
-    if (!exist && !darray_insert(entries, idx, ent)) {
-        printf("out of memory\n");
-        error = 1;
-    }
+    /* The nearest rank, as for PERCENTILE. */
+    double pos = q * len;
+    size_t rank = (size_t) pos;
+    rank += rank < pos;
+    printf(VALUE_FMT "\n", entry_select(ent, rank == 0 ? 0 : rank - 1));
+}
 
-    if (error) {
-        del_darray(elements);
-        if (!exist) {
-            del_entry(ent);
+void command_index(char *args, darray *snapshots, darray *entries) {
+    char *what = strsep(&args, WHITESPACE);
+    if (what != NULL && strcasecmp(what, "on") == 0) {
+        if (value_index == NULL) {
+            value_index = new_darray(free);
+            index_rebuild(entries);
         }
+    } else if (what != NULL && strcasecmp(what, "off") == 0) {
+        del_darray(value_index);
+        value_index = NULL;
+    } else {
+        command_error("invalid index command");
         return;
     }
 
-    entry_ref_all(ent, elements);
-
-    del_darray(elements);
     printf("ok\n");
 }
 
-void command_push(char *args, darray *snapshots, darray *entries) {
-    entry *ent;
-    if ((ent = parse_entry(&args, entries)) == NULL) {
-        printf("no such key\n");
+void command_find(char *args, darray *snapshots, darray *entries) {
+    char *lo_str = strsep(&args, WHITESPACE);
+    char *hi_str = strsep(&args, WHITESPACE);
+    value lo, hi;
+    if (lo_str == NULL || !parse_int(lo_str, &lo)) {
+        command_error("invalid integer");
+        return;
+    }
+    if (hi_str == NULL) {
+        hi = lo;
+    } else if (!parse_int(hi_str, &hi)) {
+        command_error("invalid integer");
         return;
     }
 
-    darray *elements = parse_elements(&args, entries, ent);
+    darray *found = entries_find(entries, lo, hi);
+    print_entry_list(found);
+    del_darray(found);
+}
 
-    darray_reverse(elements);
-    if (!darray_extend_at(ent->elements, 0, elements)) {
-        printf("out of memory\n");
-        del_darray(elements);
+void command_flatten(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    if ((ent = parse_entry(&args, entries)) == NULL) {
+        command_error("no such key");
         return;
     }
+    entry_print_flat(ent);
+}
 
-    entry_ref_all(ent, elements);
+void command_forward(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    if ((ent = parse_entry(&args, entries)) == NULL) {
+        command_error("no such key");
+        return;
+    }
 
-    del_darray(elements);
-    printf("ok\n");
+    darray *sorted = entry_reach(ent, 0);
+    darray_sort(sorted, (comparator) entry_key_cmp);
+    print_entry_list(sorted);
+    del_darray(sorted);
 }
 
-void command_append(char *args, darray *snapshots, darray *entries) {
+void command_backward(char *args, darray *snapshots, darray *entries) {
     entry *ent;
     if ((ent = parse_entry(&args, entries)) == NULL) {
-        printf("no such key\n");
+        command_error("no such key");
         return;
     }
 
-    darray *elements = parse_elements(&args, entries, ent);
-    if (elements == NULL) {
+    darray *sorted = entry_reach(ent, 1);
+    darray_sort(sorted, (comparator) entry_key_cmp);
+    print_entry_list(sorted);
+    del_darray(sorted);
+}
+
+void command_reach(char *args, darray *snapshots, darray *entries) {
+    entry *ent;
+    if ((ent = parse_entry(&args, entries)) == NULL) {
+        command_error("no such key");
         return;
     }
-    if (!darray_extend(ent->elements, elements)) {
-        printf("out of memory\n");
-        del_darray(elements);
+
+    darray *forward = entry_reach(ent, 0);
+    darray *backward = entry_reach(ent, 1);
+    printf("%zu forward, %zu backward\n",
+            darray_len(forward), darray_len(backward));
+    del_darray(forward);
+    del_darray(backward);
+}
+
+void command_path(char *args, darray *snapshots, darray *entries) {
+    entry *from, *to;
+    if ((from = parse_entry(&args, entries)) == NULL
+            || (to = parse_entry(&args, entries)) == NULL) {
+        command_error("no such key");
         return;
     }
 
-    entry_ref_all(ent, elements);
-
-    del_darray(elements);
-    printf("ok\n");
+    darray *path = entry_path(from, to);
+    if (darray_len(path) == 0) {
+        printf("no path\n");
+    } else {
+        print_entry_list(path);
+    }
+    del_darray(path);
 }
 
-void command_pick(char *args, darray *snapshots, darray *entries) {
+void command_depth(char *args, darray *snapshots, darray *entries) {
     entry *ent;
-    size_t idx;
-
     if ((ent = parse_entry(&args, entries)) == NULL) {
-        printf("no such key\n");
+        command_error("no such key");
         return;
     }
 
-    if (!parse_index(args, darray_len(ent->elements), &idx)) {
-        printf("index out of range\n");
+    printf("%zu\n", entry_depth(ent));
+}
+
+void command_topo(char *args, darray *snapshots, darray *entries) {
+    if (darray_len(entries) == 0) {
+        printf("no keys\n");
         return;
     }
-    idx--;
 
-    element_print(darray_get(ent->elements, idx));
-    putchar('\n');
+    darray *order = entries_topo(entries);
+    print_entry_list(order);
+    if (darray_len(order) < darray_len(entries)) {
+        printf("%zu keys in cycles\n", darray_len(entries) - darray_len(order));
+    }
+    del_darray(order);
 }
 
-void command_pluck(char *args, darray *snapshots, darray *entries) {
+void command_type(char *args, darray *snapshots, darray *entries) {
     entry *ent;
-    size_t idx;
-
     if ((ent = parse_entry(&args, entries)) == NULL) {
-        printf("no such key\n");
+        command_error("no such key");
         return;
     }
 
-    if (!parse_index(args, darray_len(ent->elements), &idx)) {
-        printf("index out of range\n");
-        return;
+    if (entry_is_simple(ent)) {
+        puts("simple");
+    } else {
+        puts("general");
     }
-    idx--;
+}
+
+/* Replication */
+
+const char *WRITE_COMMANDS[] = {
+    "set", "push", "append", "mset", "mappend", "pluck", "pop", "del",
+    "purge", "drop", "rollback", "checkout", "snapshot", "rev", "uniq",
+    "sort", "load", "sketch", "union", "intersect", "diff",
+    "add", "mul", "clamp", "filter", NULL
+};
+
+int replica_applying = 0;
+
+int command_is_write(const char *comm) {
+    for (size_t i = 0; WRITE_COMMANDS[i] != NULL; i++) {
+        if (strcasecmp(comm, WRITE_COMMANDS[i]) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void replica_send_entries(int fd, darray *entries) {
+    char *dump;
+    size_t size;
+    FILE *fp = open_memstream(&dump, &size);
+    entries_dump(entries, fp);
+    fclose(fp);
+
+    char *line;
+    char *rest = dump;
+    while ((line = strsep(&rest, "\n")) != NULL) {
+        if (*line == '\0') {
+            continue;
+        }
+        if (fd < 0) {
+            replica_broadcast(line);
+        } else {
+            replica_send(fd, line);
+        }
+    }
+    free(dump);
+}
 
-    element *ele = darray_get(ent->elements, idx);
-    element_print(ele);
-    putchar('\n');
+void replica_sync(int fd, darray *snapshots, darray *entries) {
+    char line[BUFLEN];
+    for (size_t i = darray_len(snapshots); i > 0; i--) {
+        snapshot *snap = darray_get(snapshots, i - 1);
+        replica_send_entries(fd, snap->entries);
+        sprintf(line, "SYNC SNAPSHOT %zu", snap->id);
+        replica_send(fd, line);
+        replica_send(fd, "SYNC CLEAR");
+    }
+    replica_send_entries(fd, entries);
+    sprintf(line, "SYNC NEXT %zu", next_snapshot_id);
+    replica_send(fd, line);
+}
 
-    if (ele != NULL && ele->type == ENTRY) {
-        entry_del_ref(ent, ele->value.entry);
+void command_sync(char *args, darray *snapshots, darray *entries) {
+    char *what = strsep(&args, WHITESPACE);
+    size_t id;
+    if (strcasecmp(what, "snapshot") == 0 && parse_index(args, -1, &id)) {
+        next_snapshot_id = id;
+        darray_insert(snapshots, 0, new_snapshot(entries));
+    } else if (strcasecmp(what, "clear") == 0) {
+        darray_clear(entries);
+        index_rebuild(entries);
+        keys_rebuild(entries);
+    } else if (strcasecmp(what, "next") == 0 && parse_index(args, -1, &id)) {
+        next_snapshot_id = id;
     }
-    darray_pop(ent->elements, idx);
 }
 
-void command_pop(char *args, darray *snapshots, darray *entries) {
-    entry *ent;
+void command_replication(char *args, darray *snapshots, darray *entries) {
+    replica_print_status();
+}
 
-    if ((ent = parse_entry(&args, entries)) == NULL) {
-        printf("no such key\n");
-        return;
-    }
+/* Main program */
 
-    element *ele = darray_get(ent->elements, 0);
-    element_print(ele);
-    putchar('\n');
+const char *AT_COMMANDS[] = {
+    "list", "get", "mget", "pick", "min", "max", "sum", "len", "flatten",
+    "forward", "backward", "reach", "path", "depth", "topo", "memory", "type",
+    "rank", "count", "contains", "percentile", "distinct", "quantile", NULL
+};
 
-    if (ele != NULL && ele->type == ENTRY) {
-        entry_del_ref(ent, ele->value.entry);
+int command_reads_at(const char *comm) {
+    for (size_t i = 0; AT_COMMANDS[i] != NULL; i++) {
+        if (strcasecmp(comm, AT_COMMANDS[i]) == 0) {
+            return 1;
+        }
     }
-    darray_pop(ent->elements, 0);
-}
 
-void command_drop(char *args, darray *snapshots, darray *entries) {
-    size_t idx, snap_idx = 0;
+    return 0;
+}
 
-    if (!parse_index(args, -1, &idx)) {
-        printf("index out of range\n");
-        return;
+int command_dispatch(char *comm, char *args,
+        darray *snapshots, darray *entries) {
+    /* The arguments are copied first, as running the command splits them. */
+    char line[SLOWLINELEN];
+    if (slowlog_threshold >= 0) {
+        snprintf(line, SLOWLINELEN, args == NULL ? "%s" : "%s %s", comm, args);
     }
-    if (!darray_search(snapshots,
-                &idx, (comparator) snapshot_has_id, &snap_idx)) {
-        printf("no such snapshot\n");
-        return;
+    TRACE2(command__start, comm, args);
+
+    size_t touched, allocs;
+    slowlog_take(&touched, &allocs);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int running = command_run(comm, args, snapshots, entries);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long long micros = (end.tv_sec - start.tv_sec) * 1000000LL
+        + (end.tv_nsec - start.tv_nsec) / 1000;
+    TRACE2(command__done, comm, micros);
+    if (slowlog_threshold >= 0 && micros >= slowlog_threshold) {
+        slowlog_take(&touched, &allocs);
+        slowlog_add(line, micros, touched, allocs);
     }
 
-    darray_pop(snapshots, snap_idx);
-
-    printf("ok\n");
+    return running;
 }
 
-void command_rollback(char *args, darray *snapshots, darray *entries) {
-    size_t idx, snap_idx = 0;
-
-    if (!parse_index(args, -1, &idx)) {
-        printf("index out of range\n");
-        return;
+int command_run(char *comm, char *args,
+        darray *snapshots, darray *entries) {
+    if (command_reads_at(comm) && !parse_at(args, snapshots, &entries)) {
+        return 1;
     }
-    if (!darray_search(snapshots,
-                &idx, (comparator) snapshot_has_id, &snap_idx)) {
-        printf("no such snapshot\n");
-        return;
+    if (command_is_write(comm)) {
+        if (replica_get_role() == FOLLOWER && !replica_applying) {
+            command_error("read only");
+            return 1;
+        }
+        /* A loaded file is sent as the entries it changed once loaded. */
+        if (replica_get_role() == LEADER && strcasecmp(comm, "load") != 0) {
+            char line[BUFLEN + 16];
+            if (snprintf(line, sizeof(line), "%s %s", comm,
+                        args == NULL ? "" : args) >= (int) sizeof(line)) {
+                command_error("too long to replicate");
+                return 1;
+            }
+            replica_broadcast(line);
+        }
     }
 
-    snapshot *snap = darray_get(snapshots, snap_idx);
-    darray *clone = entries_clone(snap->entries);
-    darray_clear(entries);
-    darray_extend(entries, clone);
-    darray_set_item_free(clone, NULL);
-    del_darray(clone);
+    if (strcasecmp(comm, "help") == 0) {
+        command_help();
+    } else if (strcasecmp(comm, "list") == 0) {
+        command_list(args, snapshots, entries);
+    } else if (strcasecmp(comm, "get") == 0) {
+        command_get(args, snapshots, entries);
+    } else if (strcasecmp(comm, "del") == 0) {
+        command_del(args, snapshots, entries);
+    } else if (strcasecmp(comm, "purge") == 0) {
+        command_purge(args, snapshots, entries);
+    } else if (strcasecmp(comm, "set") == 0) {
+        command_set(args, snapshots, entries);
+    } else if (strcasecmp(comm, "push") == 0) {
+        command_push(args, snapshots, entries);
+    } else if (strcasecmp(comm, "append") == 0) {
+        command_append(args, snapshots, entries);
+    } else if (strcasecmp(comm, "mget") == 0) {
+        command_mget(args, snapshots, entries);
+    } else if (strcasecmp(comm, "mset") == 0) {
+        command_mset(args, snapshots, entries);
+    } else if (strcasecmp(comm, "mappend") == 0) {
+        command_mappend(args, snapshots, entries);
+    } else if (strcasecmp(comm, "pick") == 0) {
+        command_pick(args, snapshots, entries);
+    } else if (strcasecmp(comm, "pluck") == 0) {
+        command_pluck(args, snapshots, entries);
+    } else if (strcasecmp(comm, "pop") == 0) {
+        command_pop(args, snapshots, entries);
+    } else if (strcasecmp(comm, "drop") == 0) {
+        command_drop(args, snapshots, entries);
+    } else if (strcasecmp(comm, "rollback") == 0) {
+        command_rollback(args, snapshots, entries);
+    } else if (strcasecmp(comm, "checkout") == 0) {
+        command_checkout(args, snapshots, entries);
+    } else if (strcasecmp(comm, "snapshot") == 0) {
+        command_snapshot(args, snapshots, entries);
+    } else if (strcasecmp(comm, "save") == 0) {
+        command_save(args, snapshots, entries);
+    } else if (strcasecmp(comm, "bgsave") == 0) {
+        command_bgsave(args, snapshots, entries);
+    } else if (strcasecmp(comm, "load") == 0) {
+        command_load(args, snapshots, entries);
+    } else if (strcasecmp(comm, "slowlog") == 0) {
+        command_slowlog(args, snapshots, entries);
+    } else if (strcasecmp(comm, "publish") == 0) {
+        command_publish(args, snapshots, entries);
+    } else if (strcasecmp(comm, "image") == 0) {
+        command_image(args, snapshots, entries);
+    } else if (strcasecmp(comm, "lastsave") == 0) {
+        command_lastsave(args, snapshots, entries);
+    } else if (strcasecmp(comm, "retain") == 0) {
+        command_retain(args, snapshots, entries);
+    } else if (strcasecmp(comm, "gc") == 0) {
+        command_gc(args, snapshots, entries);
+    } else if (strcasecmp(comm, "memory") == 0) {
+        command_memory(args, snapshots, entries);
+    } else if (strcasecmp(comm, "rank") == 0) {
+        command_rank(args, snapshots, entries);
+    } else if (strcasecmp(comm, "count") == 0) {
+        command_count(args, snapshots, entries);
+    } else if (strcasecmp(comm, "contains") == 0) {
+        command_contains(args, snapshots, entries);
+    } else if (strcasecmp(comm, "percentile") == 0) {
+        command_percentile(args, snapshots, entries);
+    } else if (strcasecmp(comm, "add") == 0) {
+        command_add(args, snapshots, entries);
+    } else if (strcasecmp(comm, "mul") == 0) {
+        command_mul(args, snapshots, entries);
+    } else if (strcasecmp(comm, "clamp") == 0) {
+        command_clamp(args, snapshots, entries);
+    } else if (strcasecmp(comm, "filter") == 0) {
+        command_filter(args, snapshots, entries);
+    } else if (strcasecmp(comm, "union") == 0) {
+        command_union(args, snapshots, entries);
+    } else if (strcasecmp(comm, "intersect") == 0) {
+        command_intersect(args, snapshots, entries);
+    } else if (strcasecmp(comm, "diff") == 0) {
+        command_diff(args, snapshots, entries);
+    } else if (strcasecmp(comm, "sketch") == 0) {
+        command_sketch(args, snapshots, entries);
+    } else if (strcasecmp(comm, "distinct") == 0) {
+        command_distinct(args, snapshots, entries);
+    } else if (strcasecmp(comm, "quantile") == 0) {
+        command_quantile(args, snapshots, entries);
+    } else if (strcasecmp(comm, "min") == 0) {
+        command_min(args, snapshots, entries);
+    } else if (strcasecmp(comm, "max") == 0) {
+        command_max(args, snapshots, entries);
+    } else if (strcasecmp(comm, "sum") == 0) {
+        command_sum(args, snapshots, entries);
+    } else if (strcasecmp(comm, "len") == 0) {
+        command_len(args, snapshots, entries);
+    } else if (strcasecmp(comm, "rev") == 0) {
+        command_rev(args, snapshots, entries);
+    } else if (strcasecmp(comm, "uniq") == 0) {
+        command_uniq(args, snapshots, entries);
+    } else if (strcasecmp(comm, "sort") == 0) {
+        command_sort(args, snapshots, entries);
+    } else if (strcasecmp(comm, "index") == 0) {
+        command_index(args, snapshots, entries);
+    } else if (strcasecmp(comm, "find") == 0) {
+        command_find(args, snapshots, entries);
+    } else if (strcasecmp(comm, "flatten") == 0) {
+        command_flatten(args, snapshots, entries);
+    } else if (strcasecmp(comm, "forward") == 0) {
+        command_forward(args, snapshots, entries);
+    } else if (strcasecmp(comm, "backward") == 0) {
+        command_backward(args, snapshots, entries);
+    } else if (strcasecmp(comm, "reach") == 0) {
+        command_reach(args, snapshots, entries);
+    } else if (strcasecmp(comm, "path") == 0) {
+        command_path(args, snapshots, entries);
+    } else if (strcasecmp(comm, "depth") == 0) {
+        command_depth(args, snapshots, entries);
+    } else if (strcasecmp(comm, "topo") == 0) {
+        command_topo(args, snapshots, entries);
+    } else if (strcasecmp(comm, "type") == 0) {
+        command_type(args, snapshots, entries);
+    } else if (strcasecmp(comm, "replication") == 0) {
+        command_replication(args, snapshots, entries);
+    } else if (strcasecmp(comm, "bye") == 0) {
+        printf("bye\n");
+        return 0;
+    } else {
+        command_error("no such command");
+    }
 
-    darray_pop_range(snapshots, 0, snap_idx);
+    /* Each command pays for a bounded share of the pending garbage. */
+    gc_step(GCSTEP);
 
-    printf("ok\n");
+    return 1;
 }
 
-void command_checkout(char *args, darray *snapshots, darray *entries) {
-    size_t idx, snap_idx = 0;
+int transaction_purges(darray *transaction) {
+    for (size_t i = 0; i < darray_len(transaction); i++) {
+        const char *line = darray_get(transaction, i);
+        if (strncasecmp(line, "purge", 5) == 0
+                && strchr(WHITESPACE, line[5]) != NULL) {
+            return 1;
+        }
+    }
 
-    if (!parse_index(args, -1, &idx)) {
-        printf("index out of range\n");
-        return;
+    return 0;
+}
+
+void command_exec(darray *transaction, darray *snapshots, darray *entries) {
+    /* The state is copied first, so that a failing command can undo it all. */
+    darray *saved = entries_clone(entries);
+    darray *kept = new_darray(NULL);
+    darray_extend(kept, snapshots);
+    size_t next_id = next_snapshot_id;
+
+    /* Only PURGE changes snapshots in place, so only then are they copied. */
+    darray *kept_states = NULL;
+    if (transaction_purges(transaction)) {
+        kept_states = new_darray(NULL);
+        for (size_t i = 0; i < darray_len(kept); i++) {
+            snapshot *snap = darray_get(kept, i);
+            darray_append(kept_states, entries_clone(snap->entries));
+        }
     }
-    if (!darray_search(snapshots,
-                &idx, (comparator) snapshot_has_id, &snap_idx)) {
-        printf("no such snapshot\n");
-        return;
+
+    /* Snapshots dropped on the way are freed once the outcome is known. */
+    darray_set_item_free(snapshots, NULL);
+    replica_hold();
+
+    char *text = NULL;
+    size_t size = 0;
+    FILE *capture = open_memstream(&text, &size);
+    FILE *out = stdout;
+    if (capture != NULL) {
+        stdout = capture;
     }
 
-    snapshot *snap = darray_get(snapshots, snap_idx);
-    darray *clone = entries_clone(snap->entries);
-    darray_clear(entries);
-    darray_extend(entries, clone);
-    darray_set_item_free(clone, NULL);
-    del_darray(clone);
+    int failed = capture == NULL;
+    size_t start = 0;
+    for (size_t i = 0; !failed && i < darray_len(transaction); i++) {
+        fflush(stdout);
+        start = size;
+        char *args = darray_get(transaction, i);
+        char *comm = strsep(&args, WHITESPACE);
+        command_failed = 0;
+        command_dispatch(comm, args, snapshots, entries);
+        failed = command_failed;
+    }
 
-    printf("ok\n");
-}
+    if (capture != NULL) {
+        fclose(capture);
+        stdout = out;
+    }
 
-void command_snapshot(char *args, darray *snapshots, darray *entries) {
-    snapshot *snap = new_snapshot(entries);
-    darray_insert(snapshots, 0, snap);
+    size_t idx;
+    if (failed) {
+        /* Only the reply of the failing command is shown. */
+        if (text != NULL) {
+            fwrite(text + start, 1, size - start, stdout);
+        } else {
+            printf("out of memory\n");
+        }
+        printf("transaction discarded\n");
+
+        darray_clear(entries);
+        darray_extend(entries, saved);
+        darray_set_item_free(saved, NULL);
+        del_darray(saved);
+        index_rebuild(entries);
+        keys_rebuild(entries);
+
+        for (size_t i = 0; i < darray_len(snapshots); i++) {
+            snapshot *snap = darray_get(snapshots, i);
+            if (!darray_search(kept, snap, compare_ptr, &idx)) {
+                del_snapshot(snap);
+            }
+        }
+        darray_clear(snapshots);
+        darray_extend(snapshots, kept);
+        for (size_t i = 0; kept_states != NULL && i < darray_len(kept); i++) {
+            snapshot *snap = darray_get(kept, i);
+            keys_forget(snap);
+            gc_defer(snap->entries);
+            snap->entries = darray_get(kept_states, i);
+        }
+        next_snapshot_id = next_id;
+    } else {
+        fwrite(text, 1, size, stdout);
 
-    printf("saved as snapshot ");
-    snapshot_print(snap);
+        gc_defer(saved);
+        for (size_t i = 0; i < darray_len(kept); i++) {
+            snapshot *snap = darray_get(kept, i);
+            if (!darray_search(snapshots, snap, compare_ptr, &idx)) {
+                del_snapshot(snap);
+            }
+        }
+        for (size_t i = 0; kept_states != NULL && i < darray_len(kept); i++) {
+            gc_defer(darray_get(kept_states, i));
+        }
+    }
+    free(text);
+    del_darray(kept_states);
+    del_darray(kept);
+    darray_set_item_free(snapshots, (consumer) del_snapshot);
+    replica_release(!failed);
 }
 
-void command_min(char *args, darray *snapshots, darray *entries) {
-    entry *ent;
-    if ((ent = parse_entry(&args, entries)) == NULL) {
-        printf("no such key\n");
-        return;
+darray *transaction = NULL;
+
+int command_line(char *line, darray *snapshots, darray *entries) {
+    char *queued = transaction == NULL ? NULL : strdup(line);
+    char *args = line;
+    char *comm = strsep(&args, WHITESPACE);
+    int running = 1;
+
+    if (strcasecmp(comm, "multi") == 0) {
+        if (transaction != NULL) {
+            command_error("not permitted");
+        } else {
+            transaction = new_darray(free);
+            printf("ok\n");
+        }
+    } else if (strcasecmp(comm, "exec") == 0) {
+        if (transaction == NULL) {
+            printf("no transaction\n");
+        } else {
+            command_exec(transaction, snapshots, entries);
+            del_darray(transaction);
+            transaction = NULL;
+        }
+    } else if (strcasecmp(comm, "discard") == 0) {
+        if (transaction == NULL) {
+            printf("no transaction\n");
+        } else {
+            del_darray(transaction);
+            transaction = NULL;
+            printf("ok\n");
+        }
+    } else if (queued != NULL && strcasecmp(comm, "bye") != 0) {
+        darray_append(transaction, queued);
+        queued = NULL;
+        printf("queued\n");
+    } else {
+        running = command_dispatch(comm, args, snapshots, entries);
     }
-    printf("%d\n", entry_min(ent));
+    free(queued);
+
+    return running;
 }
 
-void command_max(char *args, darray *snapshots, darray *entries) {
-    entry *ent;
-    if ((ent = parse_entry(&args, entries)) == NULL) {
-        printf("no such key\n");
-        return;
+void replica_apply(darray *commands, darray *snapshots, darray *entries) {
+    /* Replies to the leader's commands are not meant for the user. */
+    fflush(stdout);
+    int out = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+
+    replica_applying = 1;
+    for (size_t i = 0; i < darray_len(commands); i++) {
+        char *args = darray_get(commands, i);
+        char *comm = strsep(&args, WHITESPACE);
+        if (strcasecmp(comm, "sync") == 0) {
+            command_sync(args, snapshots, entries);
+        } else {
+            command_dispatch(comm, args, snapshots, entries);
+        }
     }
-    printf("%d\n", entry_max(ent));
+    replica_applying = 0;
+
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+    close(out);
 }
 
-void command_sum(char *args, darray *snapshots, darray *entries) {
-    entry *ent;
-    if ((ent = parse_entry(&args, entries)) == NULL) {
-        printf("no such key\n");
-        return;
+void replica_wait_input(darray *snapshots, darray *entries) {
+    /* Output is only flushed once there is no more input to act on. */
+    if (!input_pending()) {
+        fflush(stdout);
+    }
+    while (!input_wait(replica_leader_fd())) {
+        darray *commands = replica_receive();
+        if (commands != NULL) {
+            replica_apply(commands, snapshots, entries);
+            del_darray(commands);
+        }
     }
-    printf("%lld\n", entry_sum(ent));
 }
 
-void command_len(char *args, darray *snapshots, darray *entries) {
-    entry *ent;
-    if ((ent = parse_entry(&args, entries)) == NULL) {
-        printf("no such key\n");
-        return;
+int wire_key(const wire_frame *frame, char *key) {
+    if (frame->keylen == 0) {
+        command_error("missing key");
+        return 0;
     }
-    printf("%zu\n", entry_len(ent));
+    if (frame->keylen >= KEYLEN) {
+        command_error("invalid key");
+        return 0;
+    }
+    for (size_t i = 0; i < frame->keylen; i++) {
+        if (frame->key[i] == '\0' || strchr(WHITESPACE, frame->key[i])) {
+            command_error("invalid key");
+            return 0;
+        }
+    }
+
+    memcpy(key, frame->key, frame->keylen);
+    key[frame->keylen] = '\0';
+    if (!key_is_valid(key)) {
+        command_error("invalid key");
+        return 0;
+    }
+    return 1;
 }
 
-void command_rev(char *args, darray *snapshots, darray *entries) {
-    entry *ent;
-    if ((ent = parse_entry(&args, entries)) == NULL) {
-        printf("no such key\n");
-        return;
+value *wire_nums(const wire_frame *frame, size_t *lenp) {
+    if (frame->len % sizeof(value) != 0) {
+        command_error("invalid integers");
+        return NULL;
     }
 
-    if (!entry_is_simple(ent)) {
-        printf("entry is not simple\n");
-        return;
+    *lenp = frame->len / sizeof(value);
+    value *nums = (value *) malloc(frame->len == 0 ? 1 : frame->len);
+    if (nums == NULL) {
+        command_error("out of memory");
+        return NULL;
     }
+    memcpy(nums, frame->data, frame->len);
+    wire_swap(nums, *lenp, sizeof(value));
 
-    darray_reverse(ent->elements);
-    printf("ok\n");
+    return nums;
 }
 
-void command_uniq(char *args, darray *snapshots, darray *entries) {
-    entry *ent;
-    if ((ent = parse_entry(&args, entries)) == NULL) {
-        printf("no such key\n");
-        return;
+int wire_replicate(const char *comm, const char *key,
+        const value *nums, size_t len) {
+    if (replica_get_role() == FOLLOWER) {
+        command_error("read only");
+        return 0;
+    }
+    if (replica_get_role() != LEADER) {
+        return 1;
     }
 
-    if (!entry_is_simple(ent)) {
-        puts("entry is not simple");
-        return;
+    char line[BUFLEN];
+    size_t used = snprintf(line, BUFLEN, "%s", key);
+    for (size_t i = 0; i < len && used < BUFLEN; i++) {
+        used += snprintf(line + used, BUFLEN - used, " " VALUE_FMT, nums[i]);
+    }
+    if (used >= BUFLEN) {
+        command_error("too long to replicate");
+        return 0;
     }
 
-    darray_unique(ent->elements, (comparator) element_int_cmp);
-    printf("ok\n");
+    char full[BUFLEN + 16];
+    snprintf(full, sizeof(full), "%s %s", comm, line);
+    replica_broadcast(full);
+    return 1;
 }
 
-void command_sort(char *args, darray *snapshots, darray *entries) {
-    entry *ent;
-    if ((ent = parse_entry(&args, entries)) == NULL) {
-        printf("no such key\n");
-        return;
+value *wire_get(const wire_frame *frame, darray *entries, size_t *lenp) {
+    char key[KEYLEN];
+    if (!wire_key(frame, key)) {
+        return NULL;
     }
 
+    entry *ent;
+    if ((ent = entries_lookup(entries, key)) == NULL) {
+        command_error("no such key");
+        return NULL;
+    }
     if (!entry_is_simple(ent)) {
-        puts("entry is not simple");
-        return;
+        command_error("entry is not simple");
+        return NULL;
     }
 
-    darray_sort(ent->elements, (comparator) element_int_cmp);
-    printf("ok\n");
+    value *nums;
+    if ((nums = entry_nums(ent)) == NULL) {
+        command_error("out of memory");
+        return NULL;
+    }
+    *lenp = entry_count(ent);
+    wire_swap(nums, *lenp, sizeof(value));
+
+    return nums;
 }
 
-void command_forward(char *args, darray *snapshots, darray *entries) {
-    entry *ent;
-    if ((ent = parse_entry(&args, entries)) == NULL) {
-        printf("no such key\n");
-        return;
+int wire_write(const wire_frame *frame, darray *entries) {
+    const char *comms[] = {
+        [WIRE_SET] = "set", [WIRE_PUSH] = "push", [WIRE_APPEND] = "append"
+    };
+    char key[KEYLEN];
+    value *nums;
+    size_t len;
+    if (!wire_key(frame, key) || (nums = wire_nums(frame, &len)) == NULL) {
+        return 0;
     }
 
-    if (darray_len(ent->forward) == 0) {
-        printf("nil\n");
-    } else {
-        darray *sorted = darray_clone(ent->forward, clone_ptr);
-        darray_sort(sorted, (comparator) entry_key_cmp);
-        darray_unique(sorted, (comparator) entry_key_cmp);
+    entry *ent = NULL;
+    if (frame->op != WIRE_SET
+            && (ent = entries_lookup(entries, key)) == NULL) {
+        command_error("no such key");
+        free(nums);
+        return 0;
+    }
+    if (!wire_replicate(comms[frame->op], key, nums, len)) {
+        free(nums);
+        return 0;
+    }
+
+    darray *elements = new_darray(NULL);
+    for (size_t i = 0; i < len; i++) {
+        darray_append(elements, new_int_ele(nums[i]));
+    }
+    free(nums);
 
-        print_entry_list(sorted);
+    if (frame->op == WIRE_SET) {
+        int exist;
+        ent = entries_reset(entries, key, &exist);
+        return entry_assign(entries, ent, exist, elements);
+    }
 
-        del_darray(sorted);
+    entry_unpack(ent);
+    if (frame->op == WIRE_PUSH) {
+        darray_reverse(elements);
+        return entry_add_elements(ent, elements, 0);
     }
+    return entry_add_elements(ent, elements, darray_len(ent->elements));
 }
 
-void command_backward(char *args, darray *snapshots, darray *entries) {
-    entry *ent;
-    if ((ent = parse_entry(&args, entries)) == NULL) {
-        printf("no such key\n");
-        return;
+int wire_dispatch(const wire_frame *frame,
+        darray *snapshots, darray *entries) {
+    /* Replies are printed as for the text protocol, into memory. */
+    char *text = NULL;
+    size_t size = 0;
+    FILE *capture = open_memstream(&text, &size);
+    if (capture == NULL) {
+        return wire_reply(WIRE_ERROR, "out of memory\n", 14);
     }
+    FILE *out = stdout;
+    stdout = capture;
 
-    if (darray_len(ent->backward) == 0) {
-        printf("nil\n");
+    int running = 1;
+    value *nums = NULL;
+    size_t len = 0;
+    wire_status status = WIRE_OK;
+    if (frame->op == WIRE_COMMAND) {
+        char *line = strndup(frame->data, frame->len);
+        if (line == NULL) {
+            command_error("out of memory");
+        } else {
+            running = command_line(line, snapshots, entries);
+            free(line);
+        }
+    } else if (transaction != NULL) {
+        /* Only command frames can be queued in a transaction. */
+        command_error("not permitted");
+        status = WIRE_ERROR;
+    } else if (frame->op == WIRE_GET) {
+        if ((nums = wire_get(frame, entries, &len)) == NULL) {
+            status = WIRE_ERROR;
+        }
+    } else if (frame->op == WIRE_SET || frame->op == WIRE_PUSH
+            || frame->op == WIRE_APPEND) {
+        status = wire_write(frame, entries) ? WIRE_OK : WIRE_ERROR;
+        gc_step(GCSTEP);
     } else {
-        darray *sorted = darray_clone(ent->backward, clone_ptr);
-        darray_sort(sorted, (comparator) entry_key_cmp);
-        darray_unique(sorted, (comparator) entry_key_cmp);
+        command_error("no such command");
+        status = WIRE_ERROR;
+    }
 
-        print_entry_list(sorted);
+    fclose(capture);
+    stdout = out;
 
-        del_darray(sorted);
+    if (nums != NULL) {
+        running &= wire_reply(status, nums, len * sizeof(value));
+    } else if (frame->op == WIRE_COMMAND || status == WIRE_ERROR) {
+        running &= wire_reply(status, text, size);
+    } else {
+        running &= wire_reply(status, NULL, 0);
     }
+    free(nums);
+    free(text);
+
+    return running;
 }
 
-void command_type(char *args, darray *snapshots, darray *entries) {
-    entry *ent;
-    if ((ent = parse_entry(&args, entries)) == NULL) {
-        printf("no such key\n");
-        return;
-    }
+void wire_run(darray *snapshots, darray *entries) {
+    wire_start(STDIN_FILENO, STDOUT_FILENO);
 
-    if (entry_is_simple(ent)) {
-        puts("simple");
-    } else {
-        puts("general");
+    wire_frame frame;
+    while (1) {
+        while (!wire_wait(replica_leader_fd())) {
+            darray *commands = replica_receive();
+            if (commands != NULL) {
+                replica_apply(commands, snapshots, entries);
+                del_darray(commands);
+            }
+        }
+        if (!wire_pop(&frame)) {
+            break;
+        }
+
+        int fd;
+        while ((fd = replica_accept()) >= 0) {
+            replica_sync(fd, snapshots, entries);
+        }
+
+        if (!wire_dispatch(&frame, snapshots, entries)) {
+            break;
+        }
     }
 }
 
-/* Main program */
+#ifndef BENCH
+
+int main(int argc, char **argv) {
+    const char *load_path = NULL;
+    int binary = 0;
+
+    for (int i = 1; i < argc; i++) {
+        char host[BUFLEN];
+        int port;
+        if (strcmp(argv[i], "--leader") == 0 && i + 1 < argc
+                && sscanf(argv[i + 1], "%d", &port) == 1) {
+            if (!replica_listen(port)) {
+                fprintf(stderr, "can not listen on port %d\n", port);
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--follow") == 0 && i + 1 < argc
+                && sscanf(argv[i + 1], "%1023[^:]:%d", host, &port) == 2) {
+            if (!replica_connect(host, port)) {
+                fprintf(stderr, "can not connect to %s\n", argv[i + 1]);
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--clone-threads") == 0 && i + 1 < argc
+                && sscanf(argv[i + 1], "%zu", &clone_threads) == 1
+                && clone_threads >= 1 && clone_threads <= MAXTHREADS) {
+            i++;
+        } else if (strcmp(argv[i], "--load-threads") == 0 && i + 1 < argc
+                && sscanf(argv[i + 1], "%zu", &load_threads) == 1
+                && load_threads >= 1 && load_threads <= MAXTHREADS) {
+            i++;
+        } else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            load_path = argv[++i];
+        } else if (strcmp(argv[i], "--binary") == 0) {
+            binary = 1;
+        } else {
+            fprintf(stderr, "usage: %s [--leader <port>] "
+                    "[--follow <host>:<port>] [--clone-threads <n>] "
+                    "[--load-threads <n>] [--load <path>] [--binary]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
 
-int main() {
+    if (!binary && !input_start(STDIN_FILENO)) {
+        fprintf(stderr, "can not read input\n");
+        return 1;
+    }
 
     darray *snapshots = new_darray((consumer) del_snapshot);
     darray *entries = new_darray((consumer) del_entry);
+    keys_rebuild(entries);
+
+    char error[BUFLEN + 32];
+    if (load_path != NULL
+            && !entries_load(entries, load_path, NULL, error, sizeof(error))) {
+        fprintf(stderr, "%s\n", error);
+        del_darray(snapshots);
+        del_darray(entries);
+        return 1;
+    }
 
     char buf[BUFLEN];
-    char *args;
-    char *comm;
 
-    while (1) {
+    if (binary) {
+        wire_run(snapshots, entries);
+    }
+    while (!binary) {
         printf("> ");
 
-        if (fgets(buf, BUFLEN, stdin) == NULL) {
+        replica_wait_input(snapshots, entries);
+        if (!input_pop(buf, BUFLEN)) {
             break;
         }
-        buf[strcspn(buf, "\n")] = 0;
-
-        args = buf;
-        comm = strsep(&args, WHITESPACE);
-
-        if (strcasecmp(comm, "help") == 0) {
-            command_help();
-        } else if (strcasecmp(comm, "list") == 0) {
-            command_list(args, snapshots, entries);
-        } else if (strcasecmp(comm, "get") == 0) {
-            command_get(args, snapshots, entries);
-        } else if (strcasecmp(comm, "del") == 0) {
-            command_del(args, snapshots, entries);
-        } else if (strcasecmp(comm, "purge") == 0) {
-            command_purge(args, snapshots, entries);
-        } else if (strcasecmp(comm, "set") == 0) {
-            command_set(args, snapshots, entries);
-        } else if (strcasecmp(comm, "push") == 0) {
-            command_push(args, snapshots, entries);
-        } else if (strcasecmp(comm, "append") == 0) {
-            command_append(args, snapshots, entries);
-        } else if (strcasecmp(comm, "pick") == 0) {
-            command_pick(args, snapshots, entries);
-        } else if (strcasecmp(comm, "pluck") == 0) {
-            command_pluck(args, snapshots, entries);
-        } else if (strcasecmp(comm, "pop") == 0) {
-            command_pop(args, snapshots, entries);
-        } else if (strcasecmp(comm, "drop") == 0) {
-            command_drop(args, snapshots, entries);
-        } else if (strcasecmp(comm, "rollback") == 0) {
-            command_rollback(args, snapshots, entries);
-        } else if (strcasecmp(comm, "checkout") == 0) {
-            command_checkout(args, snapshots, entries);
-        } else if (strcasecmp(comm, "snapshot") == 0) {
-            command_snapshot(args, snapshots, entries);
-        } else if (strcasecmp(comm, "min") == 0) {
-            command_min(args, snapshots, entries);
-        } else if (strcasecmp(comm, "max") == 0) {
-            command_max(args, snapshots, entries);
-        } else if (strcasecmp(comm, "sum") == 0) {
-            command_sum(args, snapshots, entries);
-        } else if (strcasecmp(comm, "len") == 0) {
-            command_len(args, snapshots, entries);
-        } else if (strcasecmp(comm, "rev") == 0) {
-            command_rev(args, snapshots, entries);
-        } else if (strcasecmp(comm, "uniq") == 0) {
-            command_uniq(args, snapshots, entries);
-        } else if (strcasecmp(comm, "sort") == 0) {
-            command_sort(args, snapshots, entries);
-        } else if (strcasecmp(comm, "forward") == 0) {
-            command_forward(args, snapshots, entries);
-        } else if (strcasecmp(comm, "backward") == 0) {
-            command_backward(args, snapshots, entries);
-        } else if (strcasecmp(comm, "type") == 0) {
-            command_type(args, snapshots, entries);
-        } else if (strcasecmp(comm, "bye") == 0) {
-            printf("bye\n");
+
+        int fd;
+        while ((fd = replica_accept()) >= 0) {
+            replica_sync(fd, snapshots, entries);
+        }
+
+        if (!command_line(buf, snapshots, entries)) {
             break;
-        } else {
-            printf("no such command\n");
         }
 
         putchar('\n');
     }
 
+    save_poll(1);
+    published_clear();
+    del_darray(transaction);
+    del_darray(value_index);
+    del_darray(key_index);
     del_darray(snapshots);
     del_darray(entries);
+    del_darray(garbage);
 
     return 0;
 }
+
+#endif
@@ -2,6 +2,11 @@
 #define _YMIRDB_H
 
 #include <stddef.h>
+#include <stdio.h>
+
+#include "sketch.h"
+#include "value.h"
+#include "wire.h"
 
 /* Pointer helper functions */
 
@@ -16,6 +21,14 @@ int compare_ptr(const void *p1, const void *p2);
  */
 void *clone_ptr(const void *p);
 
+/* Errors */
+
+/*
+ * Prints why the running command failed, and marks it as failed so that a
+ * transaction running it is undone.
+ */
+void command_error(const char *message);
+
 /* Database */
 
 /*
@@ -26,7 +39,7 @@ typedef enum ele_type { INTEGER, ENTRY } ele_type;
 /*
  * A structure representing an element in some entry. There can be two types of
  * elements:
- * - an integer element is a number represented by C int type;
+ * - an integer element is a number represented by the value type;
  * - an entry element is reference to another entry represented by C pointer.
  */
 typedef struct element element;
@@ -37,6 +50,12 @@ typedef struct element element;
  */
 typedef struct entry entry;
 
+/*
+ * A structure holding the minimum, maximum, sum and length of an entry with
+ * all its sub-entries expanded, and whether the sum has overflowed.
+ */
+typedef struct stats stats;
+
 /*
  * A structure representing a snapshot. A snapshot can be taken at any time. Each
  * snapshot has a ID that is unique for its life-time and beyond, and a deep
@@ -44,10 +63,21 @@ typedef struct entry entry;
  */
 typedef struct snapshot snapshot;
 
+/*
+ * A worker cloning a contiguous range of the entries.
+ */
+typedef struct clone_range clone_range;
+
+/*
+ * A structure representing a posting in the value index. A posting records
+ * how many times an integer value appears directly in some entry.
+ */
+typedef struct posting posting;
+
 /*
  * Creates a new integer element.
  */
-element *new_int_ele(int num);
+element *new_int_ele(value num);
 /*
  * Creates a new entry element.
  */
@@ -59,12 +89,23 @@ element *new_ent_ele(entry *ent);
  */
 void element_print(element *ele);
 
+/*
+ * Prints the total in decimal.
+ */
+void total_print(total sum);
+
 /*
  * Compare two integer elements. Return the value of the first element minus the
  * that of the second.
  */
 int element_int_cmp(const element *ele1, const element *ele2);
 
+/*
+ * Compare two integers. Returns a negative, zero or positive value as the
+ * first is less than, equal to or greater than the second.
+ */
+int value_cmp(const value *num1, const value *num2);
+
 /*
  * Element aggregation functions.
  *
@@ -76,9 +117,9 @@ int element_int_cmp(const element *ele1, const element *ele2);
  * - len: add one to the result.
  * If the element is an entry, perform the aggregation on the entry's elements.
  */
-void element_agg_min(const element *ele, int *min);
-void element_agg_max(const element *ele, int *max);
-void element_agg_sum(const element *ele, long long *sum);
+void element_agg_min(const element *ele, value *min);
+void element_agg_max(const element *ele, value *max);
+void element_agg_sum(const element *ele, total *sum);
 void element_agg_len(const element *ele, size_t *len);
 
 /*
@@ -103,6 +144,20 @@ void entry_print(entry *ent);
  */
 int entry_is_simple(entry *ent);
 
+/*
+ * Encoding functions.
+ *
+ * - pack: replaces the elements of a simple entry with compressed integers if
+ *   the entry is long enough and compression saves memory;
+ * - unpack: restores the elements of a packed entry, so they can be changed;
+ * - clear: removes all elements, packed or not;
+ * - count: returns the number of elements, packed or not.
+ */
+void entry_pack(entry *ent);
+void entry_unpack(entry *ent);
+void entry_clear(entry *ent);
+size_t entry_count(entry *ent);
+
 /*
  * Comparator functions.
  *
@@ -115,18 +170,16 @@ int entry_key_cmp(const entry *ent, const entry *ent2);
 /*
  * Reference management functions.
  *
- * If an entry e1 is added as an element to another entry e2, we must "link"
- * them together:
- * - Update e1's forward reference with e2 and all its forward references;
- * - Update e2's backward reference with e1 and all its backward references.
- * If an entry is removed from another entry's element list, we must do the
- * reverse - "unlink" them.
- * - Remove e2 and all its forward references from e1's forward reference;
- * - Remove e1 and all its backward references from e2's backward reference;
+ * If an entry e2 is added as an element to another entry e1, we must "link"
+ * them together: e2 is added to e1's forward references and e1 is added to
+ * e2's backward references. If an entry is removed from another entry's
+ * element list, we must do the reverse - "unlink" them. The forward and
+ * backward references only hold the direct neighbours, once for each element;
+ * entries reachable through them are found by the graph functions.
  *
  * The reference all function links all entry elements in the given element
  * list.
- * The dereference all function unlinks all entries in its forward reference
+ * The dereference all function unlinks all entry elements in its own element
  * list.
  */
 void entry_add_ref(entry *ent1, entry *ent2);
@@ -134,29 +187,166 @@ void entry_del_ref(entry *ent1, entry *ent2);
 void entry_ref_all(entry *ent, darray *elements);
 void entry_deref_all(entry *ent);
 
+/*
+ * Value assignment functions, shared by the text and binary protocols. Each
+ * takes ownership of the element list, prints the reply and returns 1 if
+ * successful, 0 otherwise.
+ *
+ * - reset: returns the entry of the key emptied, or a new entry if there is
+ *   none, storing if it existed in the result pointer;
+ * - assign: sets the elements of an entry returned by reset, adding it to the
+ *   entries if new. A `NULL` element list means parsing failed;
+ * - add_elements: inserts the elements at the position in the entry.
+ */
+entry *entries_reset(darray *entries, char *key, int *existp);
+int entry_assign(darray *entries, entry *ent, int exist, darray *elements);
+int entry_add_elements(entry *ent, darray *elements, size_t idx);
+
 /*
  * Statistics functions.
  *
- * Returns the minimum, maximum, sum and length of the given entry respectively.
- * If the entry contains other entries, the same function is called on the
- * sub-entry and returned value is aggregated to the result.
+ * The stats function walks the entry and its sub-entries with an explicit
+ * stack. Each sub-entry is evaluated once per call no matter how many paths
+ * lead to it: its result is remembered in the entry, stamped with the
+ * generation of the call, and reused for every later path. A sub-entry that
+ * is reached again while it is still being evaluated is part of a cycle and
+ * is skipped.
+ *
+ * The other functions return the minimum, maximum, sum and length of the
+ * given entry respectively, as if every sub-entry were expanded in place.
  */
-int entry_min(entry *ent);
-int entry_max(entry *ent);
-long long entry_sum(entry *ent);
+stats entry_stats(entry *ent);
+value entry_min(entry *ent);
+value entry_max(entry *ent);
+total entry_sum(entry *ent);
 size_t entry_len(entry *ent);
 
+/*
+ * Order statistics functions for simple entries. An entry is known to be
+ * sorted from a SORT until its values are next added to or reordered, and
+ * then searched by bisection; other entries are scanned.
+ *
+ * - nums: returns a new array of the integers of the entry, unpacked;
+ * - rank: returns the number of integers less than the value, or less than or
+ *   equal to it if inclusive is set;
+ * - select: returns the integer at the given position in ascending order,
+ *   found by quickselect if the entry is not known to be sorted.
+ */
+value *entry_nums(entry *ent);
+size_t entry_rank(entry *ent, value num, int inclusive);
+value entry_select(entry *ent, size_t k);
+
+/*
+ * Reorders a non-empty array in place until the k-th smallest integer is at
+ * position k, and returns it.
+ */
+value nums_select(value *nums, size_t len, size_t k);
+
+/*
+ * Set functions on sorted arrays of unique integers.
+ *
+ * - unique: removes repeated neighbouring integers in place and returns the
+ *   new length;
+ * - gallop: returns the position of the first integer not less than the
+ *   given one, searching from the lower position in doubling steps, so that
+ *   a short jump ahead costs little;
+ * - union, intersect, diff: write the union, intersection or difference of
+ *   the two arrays to the output array and return its length. The output
+ *   must be able to hold both arrays. Intersection walks the shorter array
+ *   and gallops through the longer one; difference gallops through the
+ *   second array.
+ */
+typedef size_t (*set_kernel)(const value *, size_t, const value *, size_t,
+        value *);
+size_t nums_unique(value *nums, size_t len);
+size_t nums_gallop(const value *nums, size_t len, size_t lo, value num);
+size_t nums_union(const value *a, size_t alen, const value *b, size_t blen,
+        value *out);
+size_t nums_intersect(const value *a, size_t alen, const value *b,
+        size_t blen, value *out);
+size_t nums_diff(const value *a, size_t alen, const value *b, size_t blen,
+        value *out);
+
+/*
+ * Arithmetic functions over an array of integers, changing it in place.
+ *
+ * - add, mul: add or multiply every integer by the given one. Return 0 if
+ *   any result overflows, 1 otherwise;
+ * - clamp: raise integers below lo to lo and lower those above hi to hi;
+ * - filter: keep, in order, the integers comparing to the given one as cmp,
+ *   which is 1 for greater, -1 for less and 0 for equal, and return how many
+ *   are kept.
+ */
+int nums_add(value *nums, size_t len, value num);
+int nums_mul(value *nums, size_t len, value num);
+void nums_clamp(value *nums, size_t len, value lo, value hi);
+size_t nums_filter(value *nums, size_t len, int cmp, value num);
+
+/*
+ * Replaces the integers of a simple entry with the first len of the array,
+ * reusing its elements or keeping it packed where it can.
+ */
+void entry_store_nums(entry *ent, const value *nums, size_t len);
+
+/*
+ * Returns a new array of the distinct integers of a simple entry in ascending
+ * order, storing its length in the result pointer.
+ */
+value *entry_set(entry *ent, size_t *lenp);
+
+/*
+ * Combines the entries named in the arguments with the set function, and
+ * stores the result as the entry of the first key, sorted.
+ */
+void command_combine(char *args, darray *entries, set_kernel kernel);
+
+/*
+ * Sketch functions. An entry may keep a sketch of its integers, which is
+ * updated as integers are added, and marked stale when any are removed.
+ *
+ * - sketch_add: adds the integers of the element list to the sketch;
+ * - sketch_stale: marks the sketch stale;
+ * - sketch: returns the sketch of the entry, rebuilt first if it is stale,
+ *   or `NULL` if the entry keeps no sketch.
+ * The first two do nothing if the entry keeps no sketch.
+ */
+void entry_sketch_add(entry *ent, darray *elements);
+void entry_sketch_stale(entry *ent);
+sketch *entry_sketch(entry *ent);
+
+/*
+ * Prints the integers of the entry with every sub-entry expanded in place,
+ * separated by space and surrounded by square brackets. Sub-entries that
+ * would form a cycle are skipped.
+ */
+void entry_print_flat(entry *ent);
+
+/*
+ * Reference graph functions. They walk the direct references in O(V+E).
+ *
+ * - reach: returns all entries reachable through forward references, or
+ *   backward references if the backward flag is set. The entry itself is
+ *   included only if it is part of a cycle;
+ * - path: returns the shortest chain of forward references from one entry to
+ *   another, both included, or an empty array if there is none;
+ * - depth: returns the number of references in the longest chain starting at
+ *   the entry, skipping references that close a cycle;
+ * - topo: returns the entries in an order where every entry comes after the
+ *   entries it references. Entries in or behind a cycle are left out.
+ */
+darray *entry_reach(entry *ent, int backward);
+darray *entry_path(entry *from, entry *to);
+size_t entry_depth(entry *ent);
+darray *entries_topo(darray *entries);
+
 /*
  * Creates an empty copy of the entry with only the key.
  */
 entry *entry_empty_copy(entry *ent);
 
 /*
- * The find pool function accepts an array of entries as the find pool for the
- * find copy function. The find copy function accepts an entry and returns the
- * entry with the same key in the pool.
+ * Returns the copy made of the entry by the last entries_clone call.
  */
-void entry_find_pool(darray *pool);
 entry *entry_find_copy(entry *ent);
 
 /*
@@ -172,13 +362,31 @@ void del_entry(entry *ent);
 int entries_can_purge_key(darray *entries, char *key);
 void entries_purge_key(darray *entries, char *key);
 
+/*
+ * Fills in the copy of the entry made by entries_clone. The clone range run
+ * function does this for every entry of a worker's range.
+ */
+void entry_clone_body(entry *ent_ori);
+void *clone_range_run(clone_range *range);
+
 /*
  * Creates a deep copy array of the given entries. All new entries are
  * independent of the old entries and linked to themselves in the same way as
- * the old ones.
+ * the old ones. Large arrays are split into one range per clone thread.
  */
 darray *entries_clone(darray *entries);
 
+/*
+ * Memory of deleted snapshots is freed lazily. The defer function moves the
+ * entries of a deleted snapshot to the garbage, freeing the oldest ones at
+ * once if the garbage costs more than the limit. The cost of an entry is one
+ * plus the lengths of its elements and reference arrays. The step function
+ * frees garbage entries until about the given cost has been freed.
+ */
+size_t entry_cost(entry *ent);
+void gc_defer(darray *entries);
+void gc_step(size_t budget);
+
 /*
  * Creates a new snapshot of given entries. The ID is unique throughout the
  * lifetime of the program, incremented by 1 each time a new snapshot is
@@ -197,10 +405,395 @@ void snapshot_print(snapshot *snap);
 int snapshot_has_id(const snapshot *snap, const size_t *id);
 
 /*
- * Deletes the snapshot and frees all its subsequent memories.
+ * Deletes the snapshot. Its entries are handed to the garbage, which frees
+ * them later.
  */
 void del_snapshot(snapshot *snap);
 
+/* Retention */
+
+/*
+ * Returns the total cost of the entries of the snapshot, as counted by the
+ * garbage.
+ */
+size_t snapshot_cost(snapshot *snap);
+
+/*
+ * Deletes the snapshot at the given index, and tells followers to do the same.
+ */
+void snapshot_retire(darray *snapshots, size_t idx);
+
+/*
+ * Deletes the snapshots the retention policy does not keep:
+ * - the newest snapshots up to the last limit are kept;
+ * - the newest snapshot in each period of the every limit is kept, whether
+ *   or not there is a last limit;
+ * - then the oldest kept snapshots are deleted while the total cost is over
+ *   the cost limit, but the newest one is always kept.
+ * Followers keep the snapshots of their leader instead.
+ */
+void snapshots_retain(darray *snapshots);
+
+/* Persistence */
+
+/*
+ * A structure recording the state of the latest background save.
+ */
+typedef struct saving saving;
+
+/*
+ * Writes the entries to the file as SET and APPEND commands, one per line.
+ * Every key is set to the integers before its first reference, then the rest
+ * of the elements are appended, so references may form cycles. Each line fits
+ * in the command buffer, so the file can be fed back as input. Returns 1 if
+ * the write is successful, 0 otherwise.
+ */
+int entries_dump(darray *entries, FILE *fp);
+
+/*
+ * Forks a child that writes a dump of the entries to the given path. The child
+ * works on a copy-on-write image of the memory, so the caller can keep
+ * changing the entries. Returns 0 if a save is already in progress or the
+ * child can not be started, 1 otherwise.
+ */
+int entries_save(darray *entries, const char *path);
+
+/*
+ * Collects the result of the background save if it has finished. Waits for it
+ * if the wait flag is set. Returns 1 if a save is still in progress, 0
+ * otherwise.
+ */
+int save_poll(int wait);
+
+/* Publishing */
+
+/*
+ * Returns the position of the first entry in the array sorted by key whose key
+ * is not less than the given one.
+ */
+size_t sorted_key_index(darray *sorted, const char *key);
+
+/*
+ * Lays the snapshot out as an image in a new shared memory segment of the
+ * given name, replacing any of that name. Returns 1 if successful, 0
+ * otherwise.
+ */
+int snapshot_publish(snapshot *snap, const char *name);
+
+/*
+ * Removes every segment published by this process.
+ */
+void published_clear();
+
+/* Replication */
+
+/*
+ * Returns if the command only reads and so can be given `AT <id>` to read a
+ * snapshot instead of the current state.
+ */
+int command_reads_at(const char *comm);
+
+/*
+ * Returns if the command changes the state of the database. Only these
+ * commands are streamed to followers, and followers refuse them from users.
+ */
+int command_is_write(const char *comm);
+
+/*
+ * Runs one command with its arguments, timing it for the slow log and the
+ * tracepoints. Returns 0 if the command asks to exit, 1 otherwise.
+ */
+int command_dispatch(char *comm, char *args,
+        darray *snapshots, darray *entries);
+
+/*
+ * Runs one command with its arguments without timing it. Returns 0 if the
+ * command asks to exit, 1 otherwise.
+ */
+int command_run(char *comm, char *args,
+        darray *snapshots, darray *entries);
+
+/*
+ * Returns if any queued command of the transaction is PURGE.
+ */
+int transaction_purges(darray *transaction);
+
+/*
+ * Runs the queued commands in order against the current state. If any of them
+ * fails, the current state and the snapshots are put back as they were before
+ * the first one, and nothing is sent to followers.
+ */
+void command_exec(darray *transaction, darray *snapshots, darray *entries);
+
+/*
+ * Runs a line of the text protocol, from the user or a command frame. MULTI
+ * opens a transaction, after which lines are queued until EXEC runs them or
+ * DISCARD drops them. Returns 0 if the line asks to exit, 1 otherwise.
+ */
+int command_line(char *line, darray *snapshots, darray *entries);
+
+/*
+ * Sends a dump of the entries to a follower, or to every follower as state
+ * changing commands if the socket is negative.
+ */
+void replica_send_entries(int fd, darray *entries);
+
+/*
+ * Sends the whole database to a new follower: each snapshot from the oldest
+ * one, then the current state, then the next snapshot ID.
+ */
+void replica_sync(int fd, darray *snapshots, darray *entries);
+
+/*
+ * Applies commands received from the leader, discarding their replies.
+ */
+void replica_apply(darray *commands, darray *snapshots, darray *entries);
+
+/*
+ * Waits until there is user input, applying commands from the leader as they
+ * arrive in the meantime. Returns straight away unless following a leader.
+ */
+void replica_wait_input(darray *snapshots, darray *entries);
+
+/* Binary protocol */
+
+/*
+ * Frame parsing functions. Each prints why and returns a failure if the frame
+ * is not valid.
+ *
+ * - key: copies the key of the frame into a buffer of KEYLEN bytes;
+ * - nums: returns a new array of the integers in the payload, storing its
+ *   length in the result pointer.
+ */
+int wire_key(const wire_frame *frame, char *key);
+value *wire_nums(const wire_frame *frame, size_t *lenp);
+
+/*
+ * Sends a write of integers to followers as a text command. Refuses it when
+ * following a leader, or when it does not fit in a line. Returns 1 if the
+ * write may go ahead, 0 otherwise.
+ */
+int wire_replicate(const char *comm, const char *key,
+        const value *nums, size_t len);
+
+/*
+ * Returns a new array of the integers of the simple entry of the key in
+ * little-endian order, storing its length in the result pointer.
+ */
+value *wire_get(const wire_frame *frame, darray *entries, size_t *lenp);
+
+/*
+ * Runs a SET, PUSH or APPEND frame. Returns 1 if successful, 0 otherwise.
+ */
+int wire_write(const wire_frame *frame, darray *entries);
+
+/*
+ * Runs one frame and writes its reply. Returns 0 if the frame asks to exit or
+ * the reply can not be written, 1 otherwise.
+ */
+int wire_dispatch(const wire_frame *frame,
+        darray *snapshots, darray *entries);
+
+/*
+ * Runs frames from the standard input until it ends, applying commands from
+ * the leader as they arrive in the meantime.
+ */
+void wire_run(darray *snapshots, darray *entries);
+
+/*
+ * Structures used while loading a dump file:
+ * - line: a parsed SET or APPEND line, whose entry elements are resolved from
+ *   their names once every line is parsed;
+ * - chunk: a worker parsing the lines of one part of the file;
+ * - key: a key set or appended by the file, with its target entry, the first
+ *   line setting it, and the number of elements it held before the load.
+ */
+typedef struct load_line load_line;
+typedef struct load_chunk load_chunk;
+typedef struct load_key load_key;
+
+void del_load_line(load_line *line);
+
+/*
+ * Parses a line of the file in place. Returns `NULL` for a blank line. A line
+ * that can not be parsed is returned with an error message.
+ */
+load_line *load_parse_line(char *text);
+
+/*
+ * Parses every line of a chunk, stopping at the first invalid line.
+ */
+void *load_chunk_run(load_chunk *chunk);
+
+/*
+ * Parses the text of a file in place, splitting large files into chunks at
+ * line boundaries and parsing them on as many worker threads as set by
+ * `--load-threads`.
+ * Returns an array of the lines in order of the file.
+ */
+darray *load_parse(char *text, size_t len);
+
+/*
+ * Comparison functions ordering lines by key then line number, and keys by
+ * the first line setting them, latest first.
+ */
+int load_line_cmp(const load_line *line1, const load_line *line2);
+int load_key_newer(const load_key *key1, const load_key *key2);
+
+/*
+ * Returns the key of the file with the given name, or `NULL` if there is none.
+ */
+load_key *load_find(darray *keys, const char *key);
+
+/*
+ * Checks that every appended key and every referenced key is either set by the
+ * file or already exists. Returns 1 if so, 0 otherwise with the error message
+ * of the first failing line written to the buffer.
+ */
+int load_check(darray *lines, darray *keys, darray *entries,
+        char *error, size_t size);
+
+/*
+ * Applies checked lines to the entries in order, then links the references
+ * and indexes the values of every changed entry in one final pass.
+ */
+void load_apply(darray *lines, darray *keys, darray *entries);
+
+/*
+ * Loads a file of SET and APPEND lines into the entries. Nothing is changed
+ * if any line is invalid. Every entry the file sets or appends to is added to
+ * the changed array in order of the entries, unless it is `NULL`. Returns 1 if
+ * successful, 0 otherwise with an error message written to the buffer.
+ */
+int entries_load(darray *entries, const char *path, darray *changed,
+        char *error, size_t size);
+
+/* Value index */
+
+/*
+ * The value index is an optional inverted index from integer values to the
+ * entries containing them, ordered by value. It only covers the current
+ * state, and only integers held directly by an entry.
+ *
+ * - adjust: adds or removes one appearance of the value in the entry,
+ *   depending on the sign;
+ * - elements: adjusts the index for each integer in the element list;
+ * - entry: adjusts the index for each integer in the entry;
+ * - rebuild: recreates the index from the given entries.
+ * All of them do nothing while the index is turned off.
+ */
+void index_adjust(entry *ent, value value, int sign);
+void index_elements(entry *ent, darray *elements, int sign);
+void index_entry(entry *ent, int sign);
+void index_rebuild(darray *entries);
+
+/*
+ * Returns an array of the entries that contain an integer between the lower
+ * and upper bound inclusive, sorted by key. Uses the value index if it is
+ * turned on, and scans all entries otherwise.
+ */
+darray *entries_find(darray *entries, value lo, value hi);
+
+/* Key index */
+
+/*
+ * The key index holds the entries of the current state sorted by key, so
+ * that a key is found by binary search. It is owned by the entries array it
+ * was last rebuilt from. A snapshot read with AT gets its own sorted keys,
+ * built on the first such read; other arrays are searched in full.
+ *
+ * - lower_bound: returns the position of the first entry in the sorted array
+ *   not less than the key;
+ * - add: adds a new entry to the index;
+ * - remove: removes an entry from the index;
+ * - rebuild: recreates the index from the given entries and makes them its
+ *   owner;
+ * - select: sorts the keys of the snapshot if needed and uses them for its
+ *   entries;
+ * - forget: frees the sorted keys of the snapshot, before its entries change;
+ * - sorted: returns the sorted keys of the entries, or `NULL` if there are
+ *   none.
+ * Adding and removing do nothing unless the entries own the index.
+ */
+size_t keys_lower_bound(darray *sorted, const char *key);
+void keys_add(darray *entries, entry *ent);
+void keys_remove(darray *entries, entry *ent);
+void keys_rebuild(darray *entries);
+void keys_select(snapshot *snap);
+void keys_forget(snapshot *snap);
+darray *keys_sorted(darray *entries);
+
+/*
+ * Returns the entry with the given key, or `NULL` if there is none.
+ */
+entry *entries_lookup(darray *entries, const char *key);
+
+/*
+ * Returns an array of the entries with keys from the lower bound to the upper
+ * bound inclusive, or with the prefix, in order of key. Any of them can be
+ * `NULL` for no restriction.
+ */
+darray *entries_keys_range(darray *entries, const char *from, const char *to,
+        const char *prefix);
+
+/* Memory accounting */
+
+/*
+ * A structure pairing an entry with the bytes it holds.
+ */
+typedef struct usage usage;
+
+/*
+ * Functions estimating the bytes held by each part of the database. An array
+ * is counted as a fixed header and one pointer for each item; the spare
+ * capacity of an array is not visible through its interface.
+ *
+ * - entry: the entry, its element, forward and backward arrays, its integer
+ *   elements and its packed integers;
+ * - entries: the array and all its entries;
+ * - snapshot: the snapshot and all its entries;
+ * - index: the value index, or 0 if it is off.
+ */
+size_t darray_bytes(darray *arr);
+size_t entry_memory(entry *ent);
+size_t entries_memory(darray *entries);
+size_t snapshot_memory(snapshot *snap);
+size_t index_memory();
+
+/*
+ * Compares usages by bytes from largest to smallest, then by key.
+ */
+int usage_cmp(const usage *use1, const usage *use2);
+
+/* Slow log */
+
+/*
+ * A command that took at least the slow log threshold to run, with the
+ * elements it touched and the elements and entries it allocated.
+ */
+typedef struct slow_command slow_command;
+
+/*
+ * Work counter functions. Each thread counts the work it does, and the counts
+ * of all threads add up to the work of the running command.
+ *
+ * - share: hands the counts of this thread over, for a worker that is done;
+ * - take: collects the counts of all threads since the last take.
+ */
+void slowlog_share();
+void slowlog_take(size_t *touchedp, size_t *allocsp);
+
+/*
+ * Records a slow command, overwriting the oldest one once the log is full.
+ */
+void slowlog_add(const char *line, long long micros,
+        size_t touched, size_t allocs);
+
+/*
+ * Prints the slow commands from the newest one.
+ */
+void slowlog_print();
+
 /* Helper parser functions */
 
 /*
@@ -208,7 +801,29 @@ void del_snapshot(snapshot *snap);
  * in the result pointer. Returns 1 if the conversion is successful, 0
  * otherwise.
  */
-int parse_int(char *str, int *resp);
+int parse_int(char *str, value *resp);
+
+/*
+ * Converts the given number of characters, an optional minus sign followed by
+ * decimal digits only, to an integer stored in the result pointer. Unlike
+ * parse_int, it takes no leading space or plus sign, and does not need the
+ * string to end after the digits. Returns 1 if the conversion is successful,
+ * 0 otherwise.
+ */
+int parse_decimal(const char *str, size_t len, value *resp);
+
+/*
+ * Returns if the key may name a new entry. `AT` in any case is reserved for
+ * reading snapshots, so that a trailing `AT <id>` is never a key and index.
+ */
+int key_is_valid(const char *key);
+
+/*
+ * Looks for a trailing `AT <id>` in the arguments. If there is one, it is cut
+ * off the arguments and the entries of that snapshot are stored in the result
+ * pointer. Returns 0 if there is no such snapshot, 1 otherwise.
+ */
+int parse_at(char *args, darray *snapshots, darray **entriesp);
 
 /*
  * Given a non-negative integer string of base 10, converts it to a unsigned
@@ -231,4 +846,22 @@ darray *parse_elements(char **strp, darray *entries, entry *self);
  */
 entry *parse_entry(char **strp, darray *entries);
 
+/*
+ * Parse a string into a simple entry with such key. If there is no such entry
+ * or it is not simple, prints why and returns `NULL`.
+ */
+entry *parse_simple_entry(char **strp, darray *entries);
+
+/*
+ * Parse a string into a simple entry like `parse_simple_entry`, storing a new
+ * array of its integers in the result pointer to be transformed.
+ */
+entry *parse_transform(char **strp, darray *entries, value **numsp);
+
+/*
+ * Stores the transformed integers of a simple entry, keeping its indexes up to
+ * date, frees the array and reports success.
+ */
+void entry_transformed(entry *ent, value *nums, size_t len);
+
 #endif
@@ -0,0 +1,237 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "darray.h"
+
+#include "replica.h"
+
+#define LINELEN (1200)
+#define MAXFOLLOWERS (16)
+
+static replica_role role = STANDALONE;
+
+static int listener = -1;
+static int followers[MAXFOLLOWERS];
+static size_t nfollowers = 0;
+static unsigned long long sent_seq = 0;
+static darray *held = NULL;
+
+static int leader = -1;
+static char leader_name[LINELEN];
+static char inbuf[LINELEN * 4];
+static size_t inlen = 0;
+static unsigned long long applied_seq = 0;
+static long long applied_lag = 0;
+
+static long long now_millis() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+replica_role replica_get_role() {
+    return role;
+}
+
+int replica_listen(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) {
+        return 0;
+    }
+
+    int yes = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0
+            || listen(listener, MAXFOLLOWERS) != 0) {
+        close(listener);
+        listener = -1;
+        return 0;
+    }
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+    role = LEADER;
+    return 1;
+}
+
+int replica_accept() {
+    if (listener < 0 || nfollowers == MAXFOLLOWERS) {
+        return -1;
+    }
+
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+        return -1;
+    }
+    followers[nfollowers++] = fd;
+
+    return fd;
+}
+
+static void replica_drop(int fd) {
+    for (size_t i = 0; i < nfollowers; i++) {
+        if (followers[i] == fd) {
+            close(fd);
+            followers[i] = followers[--nfollowers];
+            return;
+        }
+    }
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 1;
+}
+
+void replica_send(int fd, const char *line) {
+    char frame[LINELEN];
+    int len = snprintf(frame, LINELEN, "0 %lld %s\n", now_millis(), line);
+    if (len >= LINELEN || !send_all(fd, frame, len)) {
+        replica_drop(fd);
+    }
+}
+
+void replica_broadcast(const char *line) {
+    if (role != LEADER) {
+        return;
+    }
+    if (held != NULL) {
+        darray_append(held, strdup(line));
+        return;
+    }
+
+    char frame[LINELEN];
+    int len = snprintf(frame, LINELEN, "%llu %lld %s\n",
+            ++sent_seq, now_millis(), line);
+    if (len >= LINELEN) {
+        return;
+    }
+    for (size_t i = nfollowers; i > 0; i--) {
+        if (!send_all(followers[i - 1], frame, len)) {
+            replica_drop(followers[i - 1]);
+        }
+    }
+}
+
+void replica_hold() {
+    held = new_darray(free);
+}
+
+void replica_release(int send) {
+    darray *lines = held;
+    held = NULL;
+    for (size_t i = 0; send && i < darray_len(lines); i++) {
+        replica_broadcast(darray_get(lines, i));
+    }
+    del_darray(lines);
+}
+
+int replica_connect(const char *host, int port) {
+    struct addrinfo hints, *res;
+    char service[16];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0) {
+        return 0;
+    }
+
+    leader = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (leader < 0 || connect(leader, res->ai_addr, res->ai_addrlen) != 0) {
+        if (leader >= 0) {
+            close(leader);
+        }
+        leader = -1;
+        freeaddrinfo(res);
+        return 0;
+    }
+    freeaddrinfo(res);
+
+    snprintf(leader_name, LINELEN, "%s:%d", host, port);
+    role = FOLLOWER;
+    return 1;
+}
+
+int replica_leader_fd() {
+    return leader;
+}
+
+darray *replica_receive() {
+    if (leader < 0) {
+        return NULL;
+    }
+
+    ssize_t n = read(leader, inbuf + inlen, sizeof(inbuf) - inlen);
+    if (n <= 0) {
+        close(leader);
+        leader = -1;
+        return NULL;
+    }
+    inlen += n;
+
+    darray *commands = new_darray(free);
+
+    char *start = inbuf;
+    char *end;
+    while ((end = memchr(start, '\n', inbuf + inlen - start)) != NULL) {
+        *end = '\0';
+
+        unsigned long long seq;
+        long long millis;
+        int offset;
+        if (sscanf(start, "%llu %lld %n", &seq, &millis, &offset) == 2) {
+            darray_append(commands, strdup(start + offset));
+            if (seq != 0) {
+                applied_seq = seq;
+            }
+            applied_lag = now_millis() - millis;
+        }
+        start = end + 1;
+    }
+    inlen -= start - inbuf;
+    memmove(inbuf, start, inlen);
+
+    return commands;
+}
+
+void replica_print_status() {
+    switch (role) {
+        case LEADER:
+            printf("leader, %zu followers, sequence %llu\n",
+                    nfollowers, sent_seq);
+            break;
+        case FOLLOWER:
+            printf("follower of %s%s, sequence %llu, lag %lld ms\n",
+                    leader_name, leader < 0 ? " (disconnected)" : "",
+                    applied_seq, applied_lag);
+            break;
+        default:
+            printf("standalone\n");
+    }
+}
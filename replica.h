@@ -0,0 +1,82 @@
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <stddef.h>
+
+#include "darray.h"
+
+/*
+ * Replication streams every state changing command from a leader process to
+ * its followers over TCP. Each line on the wire is
+ *
+ *     <sequence> <milliseconds> <command>
+ *
+ * where the sequence counts commands sent by the leader and the milliseconds
+ * is the wall clock time the leader sent it. A new follower first receives the
+ * whole database as a series of commands with sequence zero.
+ */
+
+/*
+ * The role of this process.
+ */
+typedef enum replica_role { STANDALONE, LEADER, FOLLOWER } replica_role;
+
+replica_role replica_get_role();
+
+/*
+ * Starts listening for followers on the given local port. Returns 1 if
+ * successful, 0 otherwise.
+ */
+int replica_listen(int port);
+
+/*
+ * Accepts one pending follower without blocking. Returns its socket, or -1 if
+ * there is no pending follower.
+ */
+int replica_accept();
+
+/*
+ * Sends a line to a single follower with sequence zero. Drops the follower if
+ * the line can not be sent.
+ */
+void replica_send(int fd, const char *line);
+
+/*
+ * Sends a state changing command to all followers with the next sequence
+ * number. Followers that can not be reached are dropped.
+ */
+void replica_broadcast(const char *line);
+
+/*
+ * Holds back state changing commands instead of sending them, until they are
+ * released. Released commands are sent in order if asked to, or dropped.
+ */
+void replica_hold();
+void replica_release(int send);
+
+/*
+ * Connects to a leader at the given host and port. Returns 1 if successful, 0
+ * otherwise.
+ */
+int replica_connect(const char *host, int port);
+
+/*
+ * Returns the socket connected to the leader, or -1 if there is none.
+ */
+int replica_leader_fd();
+
+/*
+ * Reads what the leader has sent so far and returns an array of the complete
+ * commands in order. Returns `NULL` if the leader has closed the connection.
+ */
+darray *replica_receive();
+
+/*
+ * Prints the role of this process, and its progress in the stream:
+ * - leader: the number of followers and the last sequence sent;
+ * - follower: the last sequence applied and how far behind the leader it was
+ *   when that command was applied.
+ */
+void replica_print_status();
+
+#endif
@@ -0,0 +1,253 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sketch.h"
+
+#define HLLBITS (10)
+#define HLLSIZE (1 << HLLBITS)
+#define KLLSIZE (200)
+#define KLLMIN (8)
+#define MAXLEVELS (64)
+
+struct sketch {
+    unsigned char registers[HLLSIZE];
+    value *levels[MAXLEVELS];
+    size_t sizes[MAXLEVELS];
+    size_t allocs[MAXLEVELS];
+    size_t height;
+    size_t count;
+    uint64_t rng;
+    int stale;
+};
+
+struct weighted {
+    value num;
+    uint64_t weight;
+};
+
+static uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+
+    return x ^ (x >> 31);
+}
+
+static int value_cmp(const void *a, const void *b) {
+    value x = *(const value *) a, y = *(const value *) b;
+
+    return (x > y) - (x < y);
+}
+
+static int weighted_cmp(const void *a, const void *b) {
+    return value_cmp(&((const struct weighted *) a)->num,
+            &((const struct weighted *) b)->num);
+}
+
+sketch *new_sketch() {
+    sketch *sk = (sketch *) calloc(1, sizeof(sketch));
+    if (sk != NULL) {
+        sk->height = 1;
+        sk->rng = 1;
+    }
+
+    return sk;
+}
+
+/*
+ * The capacity of a level shrinks by a third for every level above it, so
+ * most of the memory goes to the top levels, which carry the most weight.
+ */
+static size_t level_capacity(const sketch *sk, size_t level) {
+    double cap = KLLSIZE;
+    for (size_t i = level + 1; i < sk->height && cap > KLLMIN; i++) {
+        cap = cap * 2 / 3;
+    }
+
+    return cap > KLLMIN ? (size_t) cap : KLLMIN;
+}
+
+static void level_push(sketch *sk, size_t level, value num) {
+    if (sk->sizes[level] == sk->allocs[level]) {
+        size_t alloc = sk->allocs[level] == 0 ? KLLMIN : sk->allocs[level] * 2;
+        value *grown = (value *) realloc(sk->levels[level],
+                alloc * sizeof(value));
+        if (grown == NULL) {
+            return;
+        }
+        sk->levels[level] = grown;
+        sk->allocs[level] = alloc;
+    }
+    sk->levels[level][sk->sizes[level]++] = num;
+}
+
+/*
+ * Sorts a level and promotes every other integer, starting from a random one
+ * of the first two, to the level above. An odd integer out stays behind.
+ */
+static void level_compact(sketch *sk, size_t level) {
+    if (level + 1 == MAXLEVELS) {
+        return;
+    }
+    if (level + 1 == sk->height) {
+        sk->height++;
+    }
+
+    value *nums = sk->levels[level];
+    size_t len = sk->sizes[level];
+    qsort(nums, len, sizeof(value), value_cmp);
+
+    sk->rng ^= sk->rng << 13;
+    sk->rng ^= sk->rng >> 7;
+    sk->rng ^= sk->rng << 17;
+    size_t even = len & ~(size_t) 1;
+    for (size_t i = sk->rng & 1; i < even; i += 2) {
+        level_push(sk, level + 1, nums[i]);
+    }
+    if (len != even) {
+        nums[0] = nums[len - 1];
+    }
+    sk->sizes[level] = len - even;
+}
+
+void sketch_add(sketch *sk, value num) {
+    uint64_t hash = mix((uint64_t) (uvalue) num);
+    size_t idx = hash >> (64 - HLLBITS);
+    uint64_t rest = (hash << HLLBITS) | (1ULL << (HLLBITS - 1));
+    unsigned char rank = __builtin_clzll(rest) + 1;
+    if (rank > sk->registers[idx]) {
+        sk->registers[idx] = rank;
+    }
+
+    level_push(sk, 0, num);
+    for (size_t level = 0; level < sk->height; level++) {
+        if (sk->sizes[level] >= level_capacity(sk, level)) {
+            level_compact(sk, level);
+        }
+    }
+    sk->count++;
+}
+
+void sketch_clear(sketch *sk) {
+    for (size_t i = 0; i < MAXLEVELS; i++) {
+        free(sk->levels[i]);
+    }
+    memset(sk, 0, sizeof(sketch));
+    sk->height = 1;
+    sk->rng = 1;
+}
+
+void sketch_mark_stale(sketch *sk) {
+    sk->stale = 1;
+}
+
+int sketch_is_stale(const sketch *sk) {
+    return sk->stale;
+}
+
+size_t sketch_count(const sketch *sk) {
+    return sk->count;
+}
+
+size_t sketch_distinct(const sketch *sk) {
+    double sum = 0;
+    size_t zeros = 0;
+    for (size_t i = 0; i < HLLSIZE; i++) {
+        sum += ldexp(1, -sk->registers[i]);
+        zeros += sk->registers[i] == 0;
+    }
+
+    double alpha = 0.7213 / (1 + 1.079 / HLLSIZE);
+    double estimate = alpha * HLLSIZE * HLLSIZE / sum;
+    if (estimate <= 2.5 * HLLSIZE && zeros != 0) {
+        /* Small counts are better estimated from the empty registers. */
+        estimate = HLLSIZE * log((double) HLLSIZE / zeros);
+    }
+    if (estimate > sk->count) {
+        estimate = sk->count;
+    }
+
+    return (size_t) (estimate + 0.5);
+}
+
+value sketch_quantile(const sketch *sk, double q) {
+    size_t len = 0;
+    for (size_t i = 0; i < sk->height; i++) {
+        len += sk->sizes[i];
+    }
+
+    struct weighted *items = (struct weighted *)
+        malloc(len * sizeof(struct weighted));
+    if (items == NULL) {
+        return 0;
+    }
+    uint64_t total = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < sk->height; i++) {
+        for (size_t j = 0; j < sk->sizes[i]; j++) {
+            items[n].num = sk->levels[i][j];
+            items[n].weight = 1ULL << i;
+            total += items[n++].weight;
+        }
+    }
+    qsort(items, len, sizeof(struct weighted), weighted_cmp);
+
+    /* The nearest rank, as for an exact percentile. */
+    uint64_t target = (uint64_t) ceil(q * total);
+    uint64_t seen = 0;
+    value num = items[len - 1].num;
+    for (size_t i = 0; i < len; i++) {
+        seen += items[i].weight;
+        if (seen >= target) {
+            num = items[i].num;
+            break;
+        }
+    }
+    free(items);
+
+    return num;
+}
+
+size_t sketch_size(const sketch *sk) {
+    size_t size = sizeof(sketch);
+    for (size_t i = 0; i < sk->height; i++) {
+        size += sk->allocs[i] * sizeof(value);
+    }
+
+    return size;
+}
+
+sketch *sketch_clone(const sketch *sk) {
+    sketch *cpy = (sketch *) malloc(sizeof(sketch));
+    if (cpy == NULL) {
+        return NULL;
+    }
+
+    memcpy(cpy, sk, sizeof(sketch));
+    for (size_t i = 0; i < MAXLEVELS; i++) {
+        if (sk->levels[i] == NULL) {
+            continue;
+        }
+        cpy->levels[i] = (value *) malloc(sk->allocs[i] * sizeof(value));
+        if (cpy->levels[i] == NULL) {
+            cpy->sizes[i] = cpy->allocs[i] = 0;
+            continue;
+        }
+        memcpy(cpy->levels[i], sk->levels[i], sk->sizes[i] * sizeof(value));
+    }
+
+    return cpy;
+}
+
+void del_sketch(sketch *sk) {
+    if (sk == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < MAXLEVELS; i++) {
+        free(sk->levels[i]);
+    }
+    free(sk);
+}
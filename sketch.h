@@ -0,0 +1,77 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stddef.h>
+
+#include "value.h"
+
+/*
+ * A structure summarising a stream of integers in bounded memory. It holds
+ * two sketches of the same stream:
+ * - HyperLogLog: a fixed array of registers estimating the number of distinct
+ *   integers, with a standard error of about 3%;
+ * - KLL: levels of sampled integers, each integer on a level standing for
+ *   twice as many as one on the level below, estimating quantiles with a rank
+ *   error of about 1% once there are too many integers to keep them all.
+ * Integers can only be added. A sketch that can no longer follow its stream,
+ * because integers were removed from it, is marked stale by its owner.
+ */
+typedef struct sketch sketch;
+
+/*
+ * Creates a new empty sketch.
+ */
+sketch *new_sketch();
+
+/*
+ * Adds an integer to the sketch.
+ */
+void sketch_add(sketch *sk, value num);
+
+/*
+ * Empties the sketch, which is then no longer stale.
+ */
+void sketch_clear(sketch *sk);
+
+/*
+ * Stale flag functions.
+ *
+ * - mark_stale: marks the sketch as no longer following its stream;
+ * - is_stale: returns if the sketch is marked stale.
+ */
+void sketch_mark_stale(sketch *sk);
+int sketch_is_stale(const sketch *sk);
+
+/*
+ * Returns the number of integers added to the sketch.
+ */
+size_t sketch_count(const sketch *sk);
+
+/*
+ * Returns the estimated number of distinct integers added to the sketch.
+ */
+size_t sketch_distinct(const sketch *sk);
+
+/*
+ * Returns the estimated integer with a fraction q of all integers at or below
+ * it, for q from 0 to 1. The sketch must not be empty. The answer is exact
+ * while all integers are still kept on the first level.
+ */
+value sketch_quantile(const sketch *sk, double q);
+
+/*
+ * Returns the number of bytes held by the sketch.
+ */
+size_t sketch_size(const sketch *sk);
+
+/*
+ * Creates an independent copy of the sketch.
+ */
+sketch *sketch_clone(const sketch *sk);
+
+/*
+ * Deletes the sketch and frees all its subsequent memory.
+ */
+void del_sketch(sketch *sk);
+
+#endif
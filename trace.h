@@ -0,0 +1,32 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Static tracepoints for perf and bpftrace, in the `integerdb` provider:
+ *
+ *     command__start(comm, args)   before a command runs
+ *     command__done(comm, micros)  after a command has run
+ *     clone__start(entries)        before a state is copied for a snapshot
+ *     clone__done(entries)         after a state is copied
+ *     ref__add(key1, key2)         when an entry starts referencing another
+ *     ref__del(key1, key2)         when an entry stops referencing another
+ *
+ * They are compiled in whenever the SystemTap SDT header is installed, and
+ * each costs a single no-op instruction until a tracer attaches to it. Build
+ * with `make NOTRACE=1` to leave them out.
+ */
+
+#if !defined(NOTRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE1(name, a) DTRACE_PROBE1(integerdb, name, a)
+#define TRACE2(name, a, b) DTRACE_PROBE2(integerdb, name, a, b)
+#endif
+#endif
+
+#ifndef TRACE1
+#define TRACE1(name, a) do { } while (0)
+#define TRACE2(name, a, b) do { } while (0)
+#endif
+
+#endif
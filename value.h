@@ -0,0 +1,32 @@
+#ifndef VALUE_H
+#define VALUE_H
+
+#include <limits.h>
+
+/*
+ * The integer type held by integer elements, and the wider type their sums are
+ * accumulated in. Values are 32-bit by default so elements stay small. Build
+ * with `make WIDE=1` for 64-bit values summed in 128 bits.
+ */
+#ifdef WIDE_VALUES
+typedef long long value;
+typedef unsigned long long uvalue;
+typedef __int128 total;
+#define VALUE_MIN LLONG_MIN
+#define VALUE_MAX LLONG_MAX
+#define VALUE_FMT "%lld"
+#else
+typedef int value;
+typedef unsigned uvalue;
+typedef long long total;
+#define VALUE_MIN INT_MIN
+#define VALUE_MAX INT_MAX
+#define VALUE_FMT "%d"
+#endif
+
+/*
+ * The length of a buffer that can hold any value or total as text.
+ */
+#define VALUELEN (48)
+
+#endif
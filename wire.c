@@ -0,0 +1,179 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "wire.h"
+
+#define HEADLEN (4)
+#define READLEN (65536)
+#define MAXFRAME (1 << 26)
+
+static int in_fd = -1;
+static int out_fd = -1;
+static int ended = 0;
+
+/* Bytes from start to end are read but not yet taken. */
+static char *buf = NULL;
+static size_t alloc = 0;
+static size_t start = 0;
+static size_t end = 0;
+
+static uint32_t get_le32(const char *bytes) {
+    const unsigned char *b = (const unsigned char *) bytes;
+
+    return b[0] | b[1] << 8 | b[2] << 16 | (uint32_t) b[3] << 24;
+}
+
+static void put_le32(unsigned char *bytes, uint32_t num) {
+    for (size_t i = 0; i < 4; i++) {
+        bytes[i] = num >> (8 * i);
+    }
+}
+
+void wire_start(int in, int out) {
+    in_fd = in;
+    out_fd = out;
+}
+
+/*
+ * Returns the length of the frame at the start of the buffer including its
+ * header, or 0 if it has not been read completely.
+ */
+static size_t wire_ready() {
+    if (end - start < HEADLEN) {
+        return 0;
+    }
+    size_t len = HEADLEN + get_le32(buf + start);
+
+    return end - start >= len ? len : 0;
+}
+
+/*
+ * Reads what is available into the buffer, making room for at least the frame
+ * at its start. Sets the input as ended on end of file, on an error, or on a
+ * frame too long to be taken.
+ */
+static void wire_fill() {
+    size_t need = READLEN;
+    if (end - start >= HEADLEN) {
+        size_t len = HEADLEN + get_le32(buf + start);
+        if (len > MAXFRAME) {
+            ended = 1;
+            return;
+        }
+        need = len > end - start + READLEN ? len - (end - start) : READLEN;
+    }
+
+    if (start > 0) {
+        memmove(buf, buf + start, end - start);
+        end -= start;
+        start = 0;
+    }
+    if (alloc - end < need) {
+        char *grown = (char *) realloc(buf, end + need);
+        if (grown == NULL) {
+            ended = 1;
+            return;
+        }
+        buf = grown;
+        alloc = end + need;
+    }
+
+    ssize_t n;
+    while ((n = read(in_fd, buf + end, alloc - end)) < 0 && errno == EINTR);
+    if (n <= 0) {
+        ended = 1;
+        return;
+    }
+    end += n;
+}
+
+int wire_wait(int other) {
+    struct pollfd fds[2] = {
+        { in_fd, POLLIN, 0 },
+        { other, POLLIN, 0 }
+    };
+
+    while (!ended && !wire_ready()) {
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            return 1;
+        }
+        if (fds[1].revents != 0) {
+            return 0;
+        }
+        if (fds[0].revents != 0) {
+            wire_fill();
+        }
+    }
+
+    return 1;
+}
+
+int wire_pop(wire_frame *frame) {
+    while (!wire_wait(-1));
+
+    size_t len = wire_ready();
+    if (len < HEADLEN + 2) {
+        return 0;
+    }
+
+    const char *body = buf + start + HEADLEN;
+    frame->op = (unsigned char) body[0];
+    frame->keylen = (unsigned char) body[1];
+    if (2 + frame->keylen > len - HEADLEN) {
+        return 0;
+    }
+    frame->key = body + 2;
+    frame->data = frame->key + frame->keylen;
+    frame->len = len - HEADLEN - 2 - frame->keylen;
+    start += len;
+
+    return 1;
+}
+
+int wire_reply(wire_status status, const void *data, size_t len) {
+    unsigned char head[HEADLEN + 1];
+    put_le32(head, len + 1);
+    head[HEADLEN] = status;
+
+    struct iovec iov[2] = {
+        { head, sizeof(head) },
+        { (void *) data, len }
+    };
+    size_t total = sizeof(head) + len;
+    while (total > 0) {
+        ssize_t n = writev(out_fd, iov, 2);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        total -= n;
+        for (size_t i = 0; i < 2; i++) {
+            size_t step = (size_t) n < iov[i].iov_len ? (size_t) n : iov[i].iov_len;
+            iov[i].iov_base = (char *) iov[i].iov_base + step;
+            iov[i].iov_len -= step;
+            n -= step;
+        }
+    }
+
+    return 1;
+}
+
+void wire_swap(void *nums, size_t len, size_t width) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    unsigned char *bytes = (unsigned char *) nums;
+    for (size_t i = 0; i < len; i++, bytes += width) {
+        for (size_t j = 0; j < width / 2; j++) {
+            unsigned char byte = bytes[j];
+            bytes[j] = bytes[width - 1 - j];
+            bytes[width - 1 - j] = byte;
+        }
+    }
+#endif
+}
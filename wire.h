@@ -0,0 +1,87 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stddef.h>
+
+/*
+ * The binary protocol, spoken instead of the text one when the database is
+ * started with `--binary`. Every request is a frame
+ *
+ *     <length> <opcode> <key length> <key> <payload>
+ *
+ * and every reply a frame
+ *
+ *     <length> <status> <payload>
+ *
+ * where the length is a little-endian 32-bit count of the bytes after it, and
+ * the opcode, status and key length are single bytes. Integers in a payload
+ * are little-endian and as wide as values, 32 bits unless built with
+ * `WIDE=1`.
+ */
+
+/*
+ * Request opcodes.
+ *
+ * - command: the payload is a line of the text protocol, and the reply its
+ *   output as text. The key is unused. After `MULTI`, lines are queued as in
+ *   the text protocol, and frames of other opcodes are refused;
+ * - get: the reply is the integers of the simple entry of the key;
+ * - set, push, append: the payload is integers to use as the values of the
+ *   entry of the key, in the same way as the text commands. The reply is
+ *   empty.
+ */
+typedef enum wire_op {
+    WIRE_COMMAND, WIRE_GET, WIRE_SET, WIRE_PUSH, WIRE_APPEND
+} wire_op;
+
+/*
+ * Reply statuses. An error reply holds the message the text command would
+ * have printed.
+ */
+typedef enum wire_status { WIRE_OK, WIRE_ERROR } wire_status;
+
+/*
+ * A request frame. The key and payload point into the read buffer and are
+ * only valid until the next frame is taken.
+ */
+typedef struct wire_frame {
+    wire_op op;
+    const char *key;
+    size_t keylen;
+    const char *data;
+    size_t len;
+} wire_frame;
+
+/*
+ * Starts reading frames from and writing replies to the given file
+ * descriptors.
+ */
+void wire_start(int in, int out);
+
+/*
+ * Waits until there is a frame to take, the input has ended, or the other
+ * file descriptor is readable. A negative file descriptor is ignored. Returns
+ * 1 if a frame can be taken or the input has ended, 0 if the other file
+ * descriptor is readable.
+ */
+int wire_wait(int other);
+
+/*
+ * Takes the next frame, waiting for it if necessary. Returns 1 if successful,
+ * 0 if the input has ended or is not made of valid frames.
+ */
+int wire_pop(wire_frame *frame);
+
+/*
+ * Writes a reply frame with the payload as is, without copying it. Returns 1
+ * if successful, 0 otherwise.
+ */
+int wire_reply(wire_status status, const void *data, size_t len);
+
+/*
+ * Converts integers between host and little-endian byte order in place. This
+ * does nothing on little-endian hosts.
+ */
+void wire_swap(void *nums, size_t len, size_t width);
+
+#endif